@@ -0,0 +1,104 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include "app_codec.h"
+#include "host_test.h"
+
+#define FRAMES (10 * 1000 * 1000)
+
+static const uint8_t s_tmpl[18] = {0x00, 0x09, 0x00, 0x06, 0x00, 0x0a, 0x03, 0x00, 0x01, 0x01};
+/* The Syska frame */
+static const codec_frame_t s_frame = {
+    .tmpl = s_tmpl,
+    .len = sizeof(s_tmpl),
+    .fields = {
+        CODEC_FIELD(sizeof(s_tmpl), 11, 1),
+        CODEC_FIELD(sizeof(s_tmpl), 12, 1),
+        CODEC_FIELD(sizeof(s_tmpl), 13, 1),
+    },
+    .num_fields = 3,
+};
+/* The same, with a sequence counter and checksum added for the benchmark */
+static const codec_frame_t s_frame_full = {
+    .tmpl = s_tmpl,
+    .len = sizeof(s_tmpl),
+    .fields = {
+        CODEC_FIELD(sizeof(s_tmpl), 11, 1),
+        CODEC_FIELD(sizeof(s_tmpl), 12, 1),
+        CODEC_FIELD(sizeof(s_tmpl), 13, 1),
+    },
+    .num_fields = 3,
+    .seq = CODEC_FIELD_BE(sizeof(s_tmpl), 0, 2),
+    .checksum = CODEC_CHECKSUM(sizeof(s_tmpl), CODEC_CHECKSUM_XOR8, 0, 17, 17),
+};
+
+/* The frame as the Syska accessory built it before app_codec */
+static void bench_hand_built(uint32_t red, uint32_t green, uint32_t blue, uint8_t *buf)
+{
+    memcpy(buf, s_tmpl, sizeof(s_tmpl));
+    memcpy(&buf[11], &red, sizeof(uint8_t));
+    memcpy(&buf[12], &green, sizeof(uint8_t));
+    memcpy(&buf[13], &blue, sizeof(uint8_t));
+}
+
+/* As app_light encodes, with the layout only known at run time */
+static __attribute__((noipa)) void bench_run_time_layout(const codec_frame_t *frame,
+        const uint32_t *values, uint8_t *buf)
+{
+    app_codec_encode(frame, values, NULL, buf);
+}
+
+int main(void)
+{
+    uint8_t buf[sizeof(s_tmpl)];
+    uint32_t values[3], seq = 0;
+    double start, ns;
+    int i;
+
+    start = host_test_now_ns();
+    for (i = 0; i < FRAMES; i++) {
+        bench_hand_built(i, i >> 8, i >> 16, buf);
+        host_test_use(buf);
+    }
+    ns = (host_test_now_ns() - start) / FRAMES;
+    printf("hand built            %6.2f ns/frame\n", ns);
+
+    start = host_test_now_ns();
+    for (i = 0; i < FRAMES; i++) {
+        values[0] = i;
+        values[1] = i >> 8;
+        values[2] = i >> 16;
+        app_codec_encode(&s_frame, values, NULL, buf);
+        host_test_use(buf);
+    }
+    ns = (host_test_now_ns() - start) / FRAMES;
+    printf("app_codec_encode      %6.2f ns/frame (%.1f MB/s)\n", ns, sizeof(buf) * 1e3 / ns);
+
+    start = host_test_now_ns();
+    for (i = 0; i < FRAMES; i++) {
+        values[0] = i;
+        values[1] = i >> 8;
+        values[2] = i >> 16;
+        app_codec_encode(&s_frame_full, values, &seq, buf);
+        host_test_use(buf);
+    }
+    ns = (host_test_now_ns() - start) / FRAMES;
+    printf("with counter, XOR sum %6.2f ns/frame (%.1f MB/s)\n", ns, sizeof(buf) * 1e3 / ns);
+
+    start = host_test_now_ns();
+    for (i = 0; i < FRAMES; i++) {
+        values[0] = i;
+        values[1] = i >> 8;
+        values[2] = i >> 16;
+        bench_run_time_layout(&s_frame, values, buf);
+        host_test_use(buf);
+    }
+    ns = (host_test_now_ns() - start) / FRAMES;
+    printf("run time layout       %6.2f ns/frame (%.1f MB/s)\n", ns, sizeof(buf) * 1e3 / ns);
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include "app_color.h"
+#include "host_test.h"
+#include "ref_hsv2rgb.h"
+
+#define COLORS 4096
+#define ROUNDS 2000
+
+static color_hsv_t s_hsv[COLORS];
+static color_rgb_t s_rgb[COLORS];
+
+int main(void)
+{
+    color_profile_t profile;
+    uint32_t r, g, b;
+    double start, ns;
+    int i, round;
+
+    for (i = 0; i < COLORS; i++) {
+        s_hsv[i] = (color_hsv_t){.h = (i * 7) % 360, .s = (i * 3) % 101, .v = (i * 11) % 101};
+    }
+    app_color_profile_init(&profile, 220, 255, 230, 210);
+
+    start = host_test_now_ns();
+    for (round = 0; round < ROUNDS; round++) {
+        for (i = 0; i < COLORS; i++) {
+            ref_hsv2rgb(s_hsv[i].h, s_hsv[i].s, s_hsv[i].v, &r, &g, &b);
+            s_rgb[i] = (color_rgb_t){r, g, b};
+        }
+        host_test_use(s_rgb);
+    }
+    ns = (host_test_now_ns() - start) / ((double)ROUNDS * COLORS);
+    printf("reference (float)  %6.2f ns/color\n", ns);
+
+    start = host_test_now_ns();
+    for (round = 0; round < ROUNDS; round++) {
+        for (i = 0; i < COLORS; i++) {
+            app_color_hsv2rgb(&s_hsv[i], &s_rgb[i]);
+        }
+        host_test_use(s_rgb);
+    }
+    ns = (host_test_now_ns() - start) / ((double)ROUNDS * COLORS);
+    printf("app_color_hsv2rgb  %6.2f ns/color\n", ns);
+
+    start = host_test_now_ns();
+    for (round = 0; round < ROUNDS; round++) {
+        app_color_hsv2rgb_batch(s_hsv, s_rgb, COLORS, &profile);
+        host_test_use(s_rgb);
+    }
+    ns = (host_test_now_ns() - start) / ((double)ROUNDS * COLORS);
+    printf("batch with profile %6.2f ns/color\n", ns);
+    return 0;
+}
@@ -0,0 +1,34 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+/* Should not compile: each CODEC_BAD_* selects a layout that CODEC_CHECKED rejects.
+ * Built by the Makefile with every one of them, expecting a failure each time. */
+
+#include "app_codec.h"
+
+static const uint8_t s_tmpl[4];
+
+const codec_frame_t bad_frame = {
+    .tmpl = s_tmpl,
+    .len = sizeof(s_tmpl),
+    .fields = {
+#if defined(CODEC_BAD_OFFSET)
+        /* Ends one byte past the frame */
+        CODEC_FIELD(sizeof(s_tmpl), 3, 2),
+#elif defined(CODEC_BAD_WIDTH)
+        CODEC_FIELD(sizeof(s_tmpl), 0, 3),
+#else
+        CODEC_FIELD(sizeof(s_tmpl), 0, 1),
+#endif
+    },
+    .num_fields = 1,
+#if defined(CODEC_BAD_CHECKSUM)
+    /* Stored within the bytes it covers */
+    .checksum = CODEC_CHECKSUM(sizeof(s_tmpl), CODEC_CHECKSUM_SUM8, 0, 4, 3),
+#endif
+};
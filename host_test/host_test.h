@@ -0,0 +1,44 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+#include <stdio.h>
+#include <time.h>
+
+/* Failures are counted rather than aborting, so that one run reports all of them */
+static int s_failures __attribute__((unused));
+
+#define TEST_CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            s_failures++; \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+        } \
+    } while (0)
+
+#define TEST_RUN(test) do { \
+        int failures = s_failures; \
+        test(); \
+        printf("%s %s\n", s_failures == failures ? "PASS" : "FAIL", #test); \
+    } while (0)
+
+#define TEST_RESULT() (s_failures ? 1 : 0)
+
+static inline double host_test_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Keeps the compiler from optimising away the work being timed */
+static inline void host_test_use(const void *p)
+{
+    __asm__ volatile("" : : "g"(p) : "memory");
+}
@@ -0,0 +1,159 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include "app_codec.h"
+#include "host_test.h"
+
+#define CHECK_BYTES(buf, ...) do { \
+        const uint8_t expected[] = {__VA_ARGS__}; \
+        TEST_CHECK(memcmp(buf, expected, sizeof(expected)) == 0, "%s", host_test_hex(buf, sizeof(expected))); \
+    } while (0)
+
+static const char *host_test_hex(const uint8_t *buf, size_t len)
+{
+    static char str[128];
+    size_t i;
+
+    for (i = 0; i < len && i * 3 + 3 < sizeof(str); i++) {
+        sprintf(&str[i * 3], "%02x ", buf[i]);
+    }
+    return str;
+}
+
+/* The frame of the Syska light (main/accessories/syska_light.c) */
+static const uint8_t s_syska_tmpl[18] = {0x00, 0x09, 0x00, 0x06, 0x00, 0x0a, 0x03, 0x00, 0x01, 0x01};
+static const codec_frame_t s_syska_frame = {
+    .tmpl = s_syska_tmpl,
+    .len = sizeof(s_syska_tmpl),
+    .fields = {
+        CODEC_FIELD(sizeof(s_syska_tmpl), 11, 1),
+        CODEC_FIELD(sizeof(s_syska_tmpl), 12, 1),
+        CODEC_FIELD(sizeof(s_syska_tmpl), 13, 1),
+    },
+    .num_fields = 3,
+};
+
+static void test_single_byte_fields(void)
+{
+    const uint32_t values[] = {0x12, 0x34, 0x56};
+    uint8_t buf[18];
+
+    TEST_CHECK(app_codec_frame_valid(&s_syska_frame), "valid");
+    TEST_CHECK(app_codec_encode(&s_syska_frame, values, NULL, buf) == 18, "length");
+    CHECK_BYTES(buf, 0x00, 0x09, 0x00, 0x06, 0x00, 0x0a, 0x03, 0x00, 0x01, 0x01, 0x00,
+            0x12, 0x34, 0x56, 0x00, 0x00, 0x00, 0x00);
+}
+
+static void test_wide_fields(void)
+{
+    static const uint8_t tmpl[12] = {0xaa, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xbb};
+    static const codec_frame_t frame = {
+        .tmpl = tmpl,
+        .len = sizeof(tmpl),
+        .fields = {
+            CODEC_FIELD(sizeof(tmpl), 1, 2),
+            CODEC_FIELD_BE(sizeof(tmpl), 3, 2),
+            CODEC_FIELD(sizeof(tmpl), 5, 4),
+            CODEC_FIELD_BE(sizeof(tmpl), 9, 1),
+        },
+        .num_fields = 4,
+    };
+    /* Bits beyond the width of a field are dropped */
+    const uint32_t values[] = {0x1234, 0x1234, 0x12345678, 0x1ff};
+    uint8_t buf[12];
+
+    TEST_CHECK(app_codec_frame_valid(&frame), "valid");
+    app_codec_encode(&frame, values, NULL, buf);
+    CHECK_BYTES(buf, 0xaa, 0x34, 0x12, 0x12, 0x34, 0x78, 0x56, 0x34, 0x12, 0xff, 0x00, 0xbb);
+}
+
+static void test_sequence_counter(void)
+{
+    static const uint8_t tmpl[4] = {0x55};
+    static const codec_frame_t frame = {
+        .tmpl = tmpl,
+        .len = sizeof(tmpl),
+        .fields = {CODEC_FIELD(sizeof(tmpl), 3, 1)},
+        .num_fields = 1,
+        .seq = CODEC_FIELD_BE(sizeof(tmpl), 1, 2),
+    };
+    const uint32_t values[] = {0x77};
+    uint32_t seq = 0xfffe;
+    uint8_t buf[4];
+
+    app_codec_encode(&frame, values, &seq, buf);
+    CHECK_BYTES(buf, 0x55, 0xff, 0xfe, 0x77);
+    app_codec_encode(&frame, values, &seq, buf);
+    CHECK_BYTES(buf, 0x55, 0xff, 0xff, 0x77);
+    /* Wraps at the width of the field */
+    app_codec_encode(&frame, values, &seq, buf);
+    CHECK_BYTES(buf, 0x55, 0x00, 0x00, 0x77);
+    TEST_CHECK(seq == 0x10001, "counter %x", seq);
+    /* Left as in the template without a counter */
+    app_codec_encode(&frame, values, NULL, buf);
+    CHECK_BYTES(buf, 0x55, 0x00, 0x00, 0x77);
+}
+
+static void test_checksums(void)
+{
+    static const uint8_t tmpl[6] = {0x01, 0x02, 0x00, 0x00, 0xf0};
+    codec_frame_t frame = {
+        .tmpl = tmpl,
+        .len = sizeof(tmpl),
+        .fields = {CODEC_FIELD(sizeof(tmpl), 2, 2)},
+        .num_fields = 1,
+        .checksum = CODEC_CHECKSUM(sizeof(tmpl), CODEC_CHECKSUM_SUM8, 0, 5, 5),
+    };
+    const uint32_t values[] = {0x0403};
+    uint8_t buf[6];
+
+    TEST_CHECK(app_codec_frame_valid(&frame), "valid");
+    app_codec_encode(&frame, values, NULL, buf);
+    /* 0x01 + 0x02 + 0x03 + 0x04 + 0xf0, modulo 256 */
+    CHECK_BYTES(buf, 0x01, 0x02, 0x03, 0x04, 0xf0, 0xfa);
+    frame.checksum.type = CODEC_CHECKSUM_XOR8;
+    app_codec_encode(&frame, values, NULL, buf);
+    CHECK_BYTES(buf, 0x01, 0x02, 0x03, 0x04, 0xf0, 0xf4);
+}
+
+static void test_invalid_layouts(void)
+{
+    static const uint8_t tmpl[4];
+    codec_frame_t frame = {
+        .tmpl = tmpl,
+        .len = sizeof(tmpl),
+        .fields = {{.offset = 3, .width = 2}},
+        .num_fields = 1,
+    };
+
+    TEST_CHECK(!app_codec_frame_valid(&frame), "field past the end");
+    frame.fields[0] = (codec_field_t){.offset = 0, .width = 3};
+    TEST_CHECK(!app_codec_frame_valid(&frame), "width 3");
+    frame.fields[0] = (codec_field_t){.offset = 0, .width = 4};
+    TEST_CHECK(app_codec_frame_valid(&frame), "whole frame");
+    frame.seq = (codec_field_t){.offset = 4, .width = 1};
+    TEST_CHECK(!app_codec_frame_valid(&frame), "counter past the end");
+    frame.seq.width = 0;
+    frame.checksum = (codec_checksum_t){CODEC_CHECKSUM_SUM8, 0, 4, 2};
+    TEST_CHECK(!app_codec_frame_valid(&frame), "checksum over itself");
+    frame.checksum = (codec_checksum_t){CODEC_CHECKSUM_SUM8, 0, 5, 3};
+    TEST_CHECK(!app_codec_frame_valid(&frame), "checksum past the end");
+    frame.num_fields = CODEC_MAX_FIELDS + 1;
+    TEST_CHECK(!app_codec_frame_valid(&frame), "too many fields");
+    TEST_CHECK(!app_codec_frame_valid(NULL), "NULL");
+}
+
+int main(void)
+{
+    TEST_RUN(test_single_byte_fields);
+    TEST_RUN(test_wide_fields);
+    TEST_RUN(test_sequence_counter);
+    TEST_RUN(test_checksums);
+    TEST_RUN(test_invalid_layouts);
+    return TEST_RESULT();
+}
@@ -0,0 +1,119 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include "app_color.h"
+#include "host_test.h"
+#include "ref_hsv2rgb.h"
+
+/* Every hue (twice round, for the modulo), saturation and value in range */
+static void test_hsv2rgb_matches_reference(void)
+{
+    uint32_t h, s, v, r, g, b;
+    color_rgb_t rgb;
+
+    for (h = 0; h < 720; h++) {
+        for (s = 0; s <= 100; s++) {
+            for (v = 0; v <= 100; v++) {
+                color_hsv_t hsv = {.h = h, .s = s, .v = v};
+                ref_hsv2rgb(h, s, v, &r, &g, &b);
+                app_color_hsv2rgb(&hsv, &rgb);
+                TEST_CHECK(rgb.r == r && rgb.g == g && rgb.b == b,
+                        "h=%u s=%u v=%u: got %u,%u,%u expected %u,%u,%u", h, s, v,
+                        rgb.r, rgb.g, rgb.b, r, g, b);
+            }
+        }
+    }
+}
+
+static void test_batch_matches_single(void)
+{
+    color_hsv_t hsv[360];
+    color_rgb_t batch[360], single;
+    color_profile_t profile;
+    int i;
+
+    TEST_CHECK(app_color_profile_init(&profile, 220, 255, 200, 180) == ESP_OK, "profile");
+    for (i = 0; i < 360; i++) {
+        hsv[i] = (color_hsv_t){.h = i, .s = i % 101, .v = 100 - i % 101};
+    }
+    app_color_hsv2rgb_batch(hsv, batch, 360, &profile);
+    for (i = 0; i < 360; i++) {
+        app_color_hsv2rgb(&hsv[i], &single);
+        app_color_apply(&profile, &single);
+        TEST_CHECK(batch[i].r == single.r && batch[i].g == single.g && batch[i].b == single.b,
+                "color %d", i);
+    }
+}
+
+static void test_profile(void)
+{
+    color_profile_t profile;
+    color_rgb_t rgb;
+    int x;
+
+    TEST_CHECK(app_color_profile_init(&profile, 0, 255, 255, 255) == ESP_ERR_INVALID_ARG, "gamma 0");
+    TEST_CHECK(app_color_profile_init(&profile, COLOR_GAMMA_LINEAR, COLOR_WB_UNITY,
+                COLOR_WB_UNITY, COLOR_WB_UNITY) == ESP_OK, "linear");
+    for (x = 0; x < 256; x++) {
+        rgb = (color_rgb_t){x, x, x};
+        app_color_apply(&profile, &rgb);
+        TEST_CHECK(rgb.r == x && rgb.g == x && rgb.b == x, "linear profile alters %d", x);
+    }
+    TEST_CHECK(app_color_profile_init(&profile, 220, COLOR_WB_UNITY, 128, 0) == ESP_OK, "gamma 2.2");
+    rgb = (color_rgb_t){255, 255, 255};
+    app_color_apply(&profile, &rgb);
+    TEST_CHECK(rgb.r == 255 && rgb.g == 128 && rgb.b == 0, "white balance: %u,%u,%u",
+            rgb.r, rgb.g, rgb.b);
+    rgb = (color_rgb_t){128, 0, 0};
+    app_color_apply(&profile, &rgb);
+    /* (128 / 255) ^ 2.2 * 255 */
+    TEST_CHECK(rgb.r == 56 && rgb.g == 0, "gamma: %u", rgb.r);
+}
+
+static void test_percent(void)
+{
+    color_hsv_t hsv = {.h = 0, .s = app_color_percent(150), .v = app_color_percent(70000)};
+    color_rgb_t rgb;
+
+    TEST_CHECK(app_color_percent(0) == 0 && app_color_percent(100) == 100, "in range");
+    /* The Playbulb default saturation */
+    TEST_CHECK(hsv.s == 100 && hsv.v == 100, "clamped: %u %u", hsv.s, hsv.v);
+    app_color_hsv2rgb(&hsv, &rgb);
+    TEST_CHECK(rgb.r == 255 && rgb.g == 0 && rgb.b == 0, "%u,%u,%u", rgb.r, rgb.g, rgb.b);
+}
+
+static void test_cct2rgb(void)
+{
+    color_rgb_t rgb, next;
+    uint32_t k;
+
+    app_color_cct2rgb(COLOR_CCT_MIN_K - 500, 100, &rgb);
+    app_color_cct2rgb(COLOR_CCT_MIN_K, 100, &next);
+    TEST_CHECK(rgb.r == next.r && rgb.g == next.g && rgb.b == next.b, "clamped below");
+    app_color_cct2rgb(6500, 100, &rgb);
+    TEST_CHECK(rgb.r == 255 && rgb.g == 254 && rgb.b == 250, "6500 K: %u,%u,%u", rgb.r, rgb.g, rgb.b);
+    app_color_cct2rgb(6500, 0, &rgb);
+    TEST_CHECK(rgb.r == 0 && rgb.g == 0 && rgb.b == 0, "off");
+    /* Warmer to cooler, blue never decreases up to where it saturates */
+    app_color_cct2rgb(COLOR_CCT_MIN_K, 100, &rgb);
+    for (k = COLOR_CCT_MIN_K + 1; k <= COLOR_CCT_MAX_K; k++) {
+        app_color_cct2rgb(k, 100, &next);
+        TEST_CHECK(next.b >= rgb.b, "blue drops at %u K", k);
+        rgb = next;
+    }
+}
+
+int main(void)
+{
+    TEST_RUN(test_hsv2rgb_matches_reference);
+    TEST_RUN(test_batch_matches_single);
+    TEST_RUN(test_profile);
+    TEST_RUN(test_percent);
+    TEST_RUN(test_cct2rgb);
+    return TEST_RESULT();
+}
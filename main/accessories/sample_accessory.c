@@ -18,13 +18,25 @@
 static const char *TAG = "sample_accessory";
 static ble_dev_handle_t s_dev;
 
+static void sample_accessory_write_done(ble_dev_handle_t dev, int status, void *priv)
+{
+    /* Report the updated params to RainMaker using esp_rmaker_update_param() once
+     * the write has succeeded (status == 0). priv can be used to identify them. */
+}
+
+static void sample_accessory_notify(ble_dev_handle_t dev, uint8_t chr_index, const uint8_t *data, int len)
+{
+    /* Decode the value notified by the BLE accessory (for example, when it was
+     * controlled by its own remote) and report the params using esp_rmaker_update_param() */
+}
+
 static esp_err_t sample_accessory_update_dev(void)
 {
     int rc = ESP_FAIL;
     uint8_t value[REQD_DATA_SIZE];
 
-    /* Generate the sequence of bytes in the format required by the BLE accessory and write over BLE */
-    rc = app_ble_update_dev(s_dev, value, sizeof(value));
+    /* Generate the sequence of bytes in the format required by the BLE accessory and queue a write over BLE */
+    rc = app_ble_write(s_dev, 0, value, sizeof(value), sample_accessory_write_done, NULL);
     if (rc != ESP_OK) {
         ESP_LOGE(TAG, "Failed to update the accessory state");
     }
@@ -33,7 +45,6 @@ static esp_err_t sample_accessory_update_dev(void)
 
 static esp_err_t sample_accessory_cb(const char *dev_name, const char *name, esp_rmaker_param_val_t val, void *priv_data)
 {
-    esp_err_t ret;
     if (strcmp(name, "PARAM1_NAME") == 0) {
         /* You can pass the required parameters to sample_accessory_update_dev */
         sample_accessory_update_dev();
@@ -42,15 +53,11 @@ static esp_err_t sample_accessory_cb(const char *dev_name, const char *name, esp
         sample_accessory_update_dev();
     } else {
         /* Silently ignoring invalid params */
-        return ESP_OK;
-    }
-    if (ret == ESP_OK) {
-        esp_rmaker_update_param(dev_name, name, val);
     }
     return ESP_OK;
 }
 
-esp_err_t sample_accessory_add_dev(void)
+esp_err_t sample_accessory_add_dev(void *priv)
 {
     /* Create a device and add its relevant parameters using ESP RainMaker APIs.
      * Refer API Reference documentation here: https://docs.espressif.com/projects/esp-rainmaker/en/latest/c-api-reference/rainmaker_standard_types.html */
@@ -66,11 +73,19 @@ esp_err_t sample_accessory_add_dev(void)
 esp_err_t sample_accessory_register(void)
 {
     /* Populate the parameters below. Refer the documentation in main/app_ble.h for details on the parameters */
-    ble_cfg_t ble_cfg;
+    ble_cfg_t ble_cfg = {0};
     ble_cfg.adv_name = "";
-    ble_cfg.svc_uuid = ;
-    ble_cfg.chr_uuid = ;
+    /* One entry per characteristic to be controlled. The index of the entry is
+     * passed to app_ble_write(). Use BLE_UUID128_DECLARE() for 128-bit UUIDs. */
+    ble_cfg.chrs[0].svc_uuid = BLE_UUID16_DECLARE();
+    ble_cfg.chrs[0].chr_uuid = BLE_UUID16_DECLARE();
+    /* Set to true to get the state changes of the accessory through sample_accessory_notify() */
+    ble_cfg.chrs[0].subscribe = false;
+    ble_cfg.num_chrs = 1;
     ble_cfg.add = sample_accessory_add_dev;
+    ble_cfg.notify = sample_accessory_notify;
+    /* Set to true if the accessory accepts write without response (Write Command) */
+    ble_cfg.write_no_rsp = false;
 
     s_dev = app_ble_add_dev(&ble_cfg);
     if (!s_dev) {
@@ -6,6 +6,8 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 
+#include <stddef.h>
+#include <stdint.h>
 #include "esp_log.h"
 #include "nvs_flash.h"
 #include "esp_err.h"
@@ -17,85 +19,728 @@
 #include "host/util/util.h"
 #include "console/console.h"
 #include "services/gap/ble_svc_gap.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "esp_system.h"
 #include "app_ble.h"
+#include "app_ble_cache.h"
 #include "app_priv.h"
+#include "app_trace.h"
+#include "app_latency.h"
+
+/* GATT Database Hash characteristic */
+#define GATT_DB_HASH_UUID16 0x2b2a
+
+/* Advertising data types used for matching */
+#define ADV_TYPE_UUIDS16_INCOMP 0x02
+#define ADV_TYPE_UUIDS16_COMP   0x03
+#define ADV_TYPE_UUIDS128_INCOMP 0x06
+#define ADV_TYPE_UUIDS128_COMP  0x07
+#define ADV_TYPE_NAME_SHORT     0x08
+#define ADV_TYPE_NAME_COMP      0x09
+
+/* Buckets of the advertised name index, by the first character of the name */
+#define ADV_NAME_BUCKETS 32
+#define ADV_NAME_BUCKET(c) ((uint8_t)(c) % ADV_NAME_BUCKETS)
+
+/* Size of a BLE address formatted by addr_str() */
+#define ADDR_STR_LEN (6 * 2 + 5 + 1)
 
 static const char *TAG = "app_ble";
 
+/* A write submitted with app_ble_write() */
+struct ble_write {
+    uint8_t chr_index;
+    /* Value queued with app_ble_write_mbuf(), owned by the write until it is handed
+     * to the host. NULL for app_ble_write(), which copies it to data. */
+    struct os_mbuf *om;
+    uint8_t data[MAX_WRITE_LEN];
+    uint16_t len;
+    write_done_func_t cb;
+    void *priv;
+    /* write_prio_t class of the write */
+    uint8_t prio;
+    /* esp_timer_get_time() at which the write was submitted, and by which it
+     * should have been sent */
+    int64_t submitted;
+    int64_t deadline;
+    /* esp_timer_get_time() at which the command was received, and at which the
+     * write was first handed to the host (0 until then), for app_latency */
+    int64_t received;
+    int64_t sent;
+};
+
+/* A read requested with app_ble_read() */
+struct ble_read_waiter {
+    read_done_func_t cb;
+    void *priv;
+    uint8_t chr_index;
+};
+
+/* Fields of an advertisement that are relevant for matching. These point into
+ * the advertisement report, nothing is copied. */
+struct adv_info {
+    const uint8_t *name;
+    uint8_t name_len;
+    /* Little endian 16-bit and 128-bit service UUIDs */
+    const uint8_t *uuids16;
+    uint8_t num_uuids16;
+    const uint8_t *uuids128;
+    uint8_t num_uuids128;
+};
+
+/* Registered service UUID and the devices using it. uuid is the 16-bit UUID
+ * itself, or the index in s_uuids[] for 128-bit UUIDs. */
+struct adv_uuid_index {
+    uint16_t uuid;
+    uint32_t dev_mask;
+};
+
+/* A characteristic of a device, as registered and as discovered */
+struct ble_dev_chr {
+    /* Indices in s_uuids[] */
+    uint8_t svc_uuid;
+    uint8_t chr_uuid;
+    /* Handle range of the service, while discovering */
+    uint16_t svc_start_handle;
+    uint16_t svc_end_handle;
+    /* 0 if the characteristic was not found */
+    uint16_t val_handle;
+    uint8_t properties;
+    /* Write without response is configured and supported */
+    bool write_no_rsp;
+    /* Subscription to notifications or indications */
+    bool subscribe;
+    /* Last handle of the characteristic definition, bounding the descriptor discovery */
+    uint16_t end_handle;
+    /* Client Characteristic Configuration Descriptor, 0 if not discovered */
+    uint16_t cccd_handle;
+    /* Latest notified value, held back until NOTIFY_MIN_INTERVAL_MS has elapsed
+     * since the previous one was passed to the accessory */
+    int64_t notify_last;
+    uint8_t notify_data[MAX_NOTIFY_LEN];
+    uint8_t notify_len;
+    bool notify_pending;
+    /* Value from the last read or notification, served to readers for read_ttl_ms */
+    uint32_t read_ttl_ms;
+    uint8_t read_data[MAX_READ_LEN];
+    uint8_t read_len;
+    int64_t read_time;
+    bool read_valid;
+    bool read_in_flight;
+};
+
 struct ble_dev {
     const char *adv_name;
-    uint16_t svc_uuid;
-    uint16_t chr_uuid;
+    uint8_t adv_name_len;
+    /* See ble_cfg_t.instance */
+    uint8_t instance;
+    /* adv_name of a slot that app_ble_add_dev() has claimed but not filled yet, so
+     * that a concurrent add of the same instance sees it. Protected by s_write_lock. */
+    const char *claim_name;
+    /* Another device is registered with the same adv_name, so advertisers are told
+     * apart by their address. Set by app_ble_adv_index_build(). */
+    bool shared;
+    struct ble_dev_chr chrs[MAX_CHR];
+    uint8_t num_chrs;
     add_func_t add;
+    void *add_priv;
+    notify_func_t notify;
+    bool write_no_rsp;
     uint16_t conn_handle;
+    /* Last known address of the device, from an advertisement seen recently or
+     * from NVS (stored_addr). Used to connect directly, without a scan. */
     ble_addr_t addr;
-    struct ble_gatt_svc svc;
-    struct ble_gatt_chr chr;
-    bool reconnect;
+    bool addr_valid;
+    ble_addr_t stored_addr;
+    bool has_stored_addr;
+    /* The pending connection is to the known address, without a scan */
+    bool direct_connect;
+    /* The last direct connection attempt failed, so scan for the device instead */
+    bool direct_failed;
+    /* Advertiser seen in the current scan window, waiting for its turn to connect */
+    bool connect_pending;
+    /* Added after app_ble_start(), so looked for in the background until found */
+    bool hotplug;
+    /* app_ble_remove_dev() called. Freed once the connection is down. */
+    bool removing;
+    /* ble_gap_connect() initiated, waiting for BLE_GAP_EVENT_CONNECT */
+    bool connecting;
+    /* Device has been added to RainMaker (add() called) */
+    bool added;
+    /* Connected and characteristic discovered, so writes can be sent */
+    bool ready;
+    /* Handles taken from the NVS cache rather than discovered on this connection */
+    bool handles_cached;
+    /* Database Hash of the peer, if it exposes one */
+    bool has_db_hash;
+    uint8_t db_hash[GATT_DB_HASH_LEN];
+    /* The Database Hash being read did not match, and rediscovery has started. The
+     * rest of that read is ignored. */
+    bool db_hash_mismatch;
+    /* Connection pool */
+    uint8_t priority;
+    /* Last time the device was connected to or written to */
+    int64_t last_used;
+    /* Being disconnected to make room for another device */
+    bool evicting;
+    /* Reconnection requested because writes are waiting for the device, and not
+     * taken up by app_ble_reconnect_run() yet */
+    bool reconnect_wanted;
+    /* Part of the reconnection round in progress */
+    bool reconnecting;
+    int64_t reconnect_start_time;
+    /* Reconnections failed in a row. The device is considered gone from
+     * RECONNECT_BREAKER_FAILURES onwards. */
+    uint8_t reconnect_failures;
+    /* At most one write in flight for the device, and one pending per characteristic.
+     * A newer write replaces the pending one (last writer wins). The pending slots
+     * (and write_pending_mask, a bit per characteristic) are filled from the caller's
+     * task and drained in the NimBLE host task, hence they are protected by
+     * s_write_lock. The in flight slot is only accessed in the host task. */
+    struct ble_write write_pending[MAX_CHR];
+    uint8_t write_pending_mask;
+    struct ble_write write_inflight;
+    bool write_in_flight;
+    /* Write commands (without response) that can still be sent before an
+     * acknowledged write is required. Restored when an acknowledged write completes. */
+    uint8_t no_rsp_credits;
+    ble_dev_stats_t stats;
+    /* Characteristic being subscribed to, after discovery */
+    uint8_t subscribe_index;
+    /* Readers waiting for a value. Added to from the caller's task, hence protected
+     * by s_write_lock. */
+    struct ble_read_waiter read_waiters[MAX_READ_WAITERS];
+    uint8_t num_read_waiters;
+
+    /* Everything below belongs to the slot rather than the device, and is kept
+     * when the device is removed (see app_ble_dev_free()) */
+    /* Incremented each time the slot is freed, and part of the device handle */
+    uint16_t generation;
+    /* Posted to the host task to process the write queue */
+    struct ble_npl_event write_ev;
+    /* Fires when the write at the head of the queue reaches its deadline */
+    struct ble_npl_callout write_timer;
+    /* Fires when held back notified values can be passed to the accessory */
+    struct ble_npl_callout notify_timer;
+    /* Posted to the host task to process the waiting readers */
+    struct ble_npl_event read_ev;
+    /* Fires when a device that dropped off is to be reconnected in the background */
+    struct ble_npl_callout backoff_timer;
 };
 
+/* Device handles: slot index in the low byte, slot generation (never 0) above it */
+#define DEV_HANDLE(dev_index, gen) (((uint32_t)(gen) << 8) | (dev_index))
+#define DEV_HANDLE_INDEX(handle) ((handle) & 0xff)
+#define DEV_HANDLE_GEN(handle) ((handle) >> 8)
+
 static struct ble_dev s_ble_dev[MAX_DEV];
-static SemaphoreHandle_t s_sem;
+/* Indices of the registered devices for matching advertisements, built by
+ * app_ble_adv_index_build(). A bit set in a mask means that the device at that
+ * index in s_ble_dev[] is a candidate. */
+_Static_assert(MAX_DEV <= 32, "Device masks are 32-bit");
+_Static_assert(MAX_CHR <= 8, "Pending write masks are 8-bit");
+static uint32_t s_adv_name_index[ADV_NAME_BUCKETS];
+static struct adv_uuid_index s_adv_uuid_index[MAX_DEV * MAX_CHR];
+static int s_adv_uuid_index_len;
+static struct adv_uuid_index s_adv_uuid128_index[MAX_UUIDS];
+static int s_adv_uuid128_index_len;
+/* UUIDs of the registered services and characteristics. Each distinct UUID is
+ * stored once and referred to by its index, so that 128-bit UUIDs don't add up
+ * across devices of the same model. */
+_Static_assert(MAX_UUIDS <= 255, "UUID indices are 8-bit");
+static ble_uuid_any_t s_uuids[MAX_UUIDS];
+static int s_num_uuids;
+/* Number of characteristics of the registered devices using each entry of s_uuids[].
+ * An entry no device uses any more is reused. */
+static uint8_t s_uuid_refs[MAX_UUIDS];
+#define UUID(index) (&s_uuids[index].u)
+/* Only blocks app_ble_start() for the boot time discovery. Afterwards, every caller
+ * is notified through its own callback, per device and per request. */
+static SemaphoreHandle_t s_boot_sem;
+static portMUX_TYPE s_write_lock = portMUX_INITIALIZER_UNLOCKED;
+/* Set while the boot time discovery (app_ble_start()) is in progress */
+static bool s_booting;
+static int64_t s_boot_start_time;
+/* The scan in progress is a reconnection round, looking for the devices marked
+ * reconnecting rather than for all registered devices */
+static bool s_scan_reconnect;
+/* The current scan only reports devices in the controller's filter accept list */
+static bool s_scan_accept_list;
+/* ATT reads in flight across all the devices, bounded by MAX_READS_IN_FLIGHT */
+static int s_reads_in_flight;
+/* Retries a connection that is waiting for room in the connection pool */
+static struct ble_npl_callout s_conn_pool_timer;
+/* Device connected last by app_ble_connect_next(), from which the next one of the
+ * same class is looked for, so that the devices of a class take turns */
+static uint32_t s_connect_last;
+/* Pending writes across the devices, protected by s_write_lock */
+static ble_sched_stats_t s_sched_stats;
+/* Set once app_ble_start() has initialised the host. Devices added or removed after
+ * that are handled in the host task, through s_registry_ev. */
+static bool s_started;
+/* Slots in use, including the ones being filled by app_ble_add_dev() and the ones
+ * of removed devices that are not freed yet. Protected by s_write_lock. */
+static uint32_t s_dev_claimed;
+static struct ble_npl_event s_registry_ev;
+/* Looks again for the devices added after app_ble_start() that are not found yet */
+static struct ble_npl_callout s_registry_timer;
 
 static int app_ble_gap_event(struct ble_gap_event *event, void *arg);
+static void app_ble_write_complete(uint32_t dev_index, int status);
+static void app_ble_write_fail_pending(uint32_t dev_index, uint8_t chr_mask, int status);
+static void app_ble_write_retry(uint32_t dev_index);
+static int app_ble_write_next(struct ble_dev *dev);
+static void app_ble_write_process(uint32_t dev_index);
+static void app_ble_write_ev_cb(struct ble_npl_event *ev);
+static void app_ble_reconnect(uint32_t dev_index);
+static void app_ble_reconnect_run(void);
+static void app_ble_reconnect_done(uint32_t dev_index, int status);
+static void app_ble_backoff(uint32_t dev_index);
+static void app_ble_discover(uint32_t dev_index);
+static void app_ble_subscribe(uint32_t dev_index);
+static void app_ble_connect_next(void);
+static void app_ble_store_addr(uint32_t dev_index);
+static void app_ble_adv_index_build(void);
+static void app_ble_dev_free(uint32_t dev_index);
+static void app_ble_dev_teardown(uint32_t dev_index);
+static char *addr_str(const void *addr, char *buf);
+
+/**
+ * Returns the device a handle refers to, or NULL if the handle is stale or invalid
+ */
+static struct ble_dev *app_ble_dev_get(ble_dev_handle_t handle)
+{
+    uint32_t dev_index = DEV_HANDLE_INDEX(handle);
+    struct ble_dev *dev;
+
+    if (dev_index >= MAX_DEV) {
+        return NULL;
+    }
+    dev = &s_ble_dev[dev_index];
+    if (!dev->adv_name || dev->removing || dev->generation != DEV_HANDLE_GEN(handle)) {
+        return NULL;
+    }
+    return dev;
+}
+
+static ble_dev_handle_t app_ble_dev_handle(const struct ble_dev *dev)
+{
+    return DEV_HANDLE(dev - s_ble_dev, dev->generation);
+}
+
+/**
+ * Returns the index of the UUID in s_uuids[], adding it if required, and takes a
+ * reference to it. Should be called with s_write_lock held.
+ *
+ * @return index, or -1 if the table is full.
+ */
+static int app_ble_uuid_intern(const ble_uuid_t *uuid)
+{
+    int i, unused = -1;
+
+    for (i = 0; i < s_num_uuids; i++) {
+        if (!s_uuid_refs[i]) {
+            if (unused < 0) {
+                unused = i;
+            }
+        } else if (ble_uuid_cmp(UUID(i), uuid) == 0) {
+            s_uuid_refs[i]++;
+            return i;
+        }
+    }
+    if (unused < 0) {
+        if (s_num_uuids == MAX_UUIDS) {
+            return -1;
+        }
+        unused = s_num_uuids++;
+    }
+    ble_uuid_copy(&s_uuids[unused], uuid);
+    s_uuid_refs[unused] = 1;
+    return unused;
+}
+
+/**
+ * Drops a reference taken by app_ble_uuid_intern(). Should be called with
+ * s_write_lock held.
+ */
+static void app_ble_uuid_release(int index)
+{
+    if (index >= 0 && s_uuid_refs[index]) {
+        s_uuid_refs[index]--;
+    }
+}
+
+/**
+ * Formats the UUID at index in s_uuids[] into buf, which should hold at least
+ * BLE_UUID_STR_LEN bytes
+ */
+static char *uuid_str(uint8_t index, char *buf)
+{
+    return ble_uuid_to_str(UUID(index), buf);
+}
+
+static const char *s_state_names[BLE_DEV_STATE_MAX] = {
+    [BLE_DEV_STATE_IDLE] = "idle",
+    [BLE_DEV_STATE_SCANNING] = "scanning",
+    [BLE_DEV_STATE_CONNECTING] = "connecting",
+    [BLE_DEV_STATE_DISCOVERING] = "discovering",
+    [BLE_DEV_STATE_READY] = "ready",
+    [BLE_DEV_STATE_BACKOFF] = "backoff",
+};
+
+#define STATE_BIT(state) (1 << (state))
+/* States that can be moved to from each state */
+static const uint8_t s_state_next[BLE_DEV_STATE_MAX] = {
+    [BLE_DEV_STATE_IDLE] = STATE_BIT(BLE_DEV_STATE_SCANNING) | STATE_BIT(BLE_DEV_STATE_CONNECTING)
+            | STATE_BIT(BLE_DEV_STATE_BACKOFF),
+    [BLE_DEV_STATE_SCANNING] = STATE_BIT(BLE_DEV_STATE_CONNECTING) | STATE_BIT(BLE_DEV_STATE_IDLE)
+            | STATE_BIT(BLE_DEV_STATE_BACKOFF),
+    [BLE_DEV_STATE_CONNECTING] = STATE_BIT(BLE_DEV_STATE_DISCOVERING) | STATE_BIT(BLE_DEV_STATE_IDLE)
+            | STATE_BIT(BLE_DEV_STATE_BACKOFF),
+    [BLE_DEV_STATE_DISCOVERING] = STATE_BIT(BLE_DEV_STATE_READY) | STATE_BIT(BLE_DEV_STATE_IDLE)
+            | STATE_BIT(BLE_DEV_STATE_BACKOFF),
+    [BLE_DEV_STATE_READY] = STATE_BIT(BLE_DEV_STATE_DISCOVERING) | STATE_BIT(BLE_DEV_STATE_IDLE)
+            | STATE_BIT(BLE_DEV_STATE_BACKOFF),
+    [BLE_DEV_STATE_BACKOFF] = STATE_BIT(BLE_DEV_STATE_SCANNING) | STATE_BIT(BLE_DEV_STATE_CONNECTING)
+            | STATE_BIT(BLE_DEV_STATE_IDLE),
+};
+
+/**
+ * Moves the device to a new connection state. Transitions missing from
+ * s_state_next are reported, as they point at an event handled out of order.
+ */
+static void app_ble_dev_set_state(uint32_t dev_index, ble_dev_state_t state)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    ble_dev_state_t prev = dev->stats.state;
+
+    if (state == prev) {
+        return;
+    }
+    if (!(s_state_next[prev] & STATE_BIT(state))) {
+        ESP_LOGW(TAG, "Unexpected transition of %s (instance %d): %s -> %s", dev->adv_name,
+                dev->instance, s_state_names[prev], s_state_names[state]);
+    }
+    app_trace_record(APP_TRACE_STATE, dev_index, prev << 8 | state, 0);
+    dev->stats.state = state;
+    dev->stats.state_changes++;
+}
+
+/**
+ * Returns the delay before the next background reconnection, for the given number
+ * of failures in a row
+ */
+static uint32_t app_ble_backoff_ms(uint8_t failures)
+{
+    uint32_t delay_ms = RECONNECT_BACKOFF_MIN_MS;
+    uint32_t jitter_ms;
+
+    while (failures-- && delay_ms < RECONNECT_BACKOFF_MAX_MS) {
+        delay_ms *= 2;
+    }
+    if (delay_ms > RECONNECT_BACKOFF_MAX_MS) {
+        delay_ms = RECONNECT_BACKOFF_MAX_MS;
+    }
+    jitter_ms = delay_ms * RECONNECT_BACKOFF_JITTER_PCT / 100;
+    return delay_ms - jitter_ms + esp_random() % (2 * jitter_ms + 1);
+}
+
+/**
+ * Schedules the background reconnection of a device that lost its connection, or
+ * failed to reconnect (reconnect_failures is incremented by the caller). Once the
+ * device is considered gone, it is only probed every RECONNECT_PROBE_MS.
+ */
+static void app_ble_backoff(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    uint32_t delay_ms;
+
+    if (!dev->added || dev->removing) {
+        /* Looked for by the registry instead */
+        app_ble_dev_set_state(dev_index, BLE_DEV_STATE_IDLE);
+        return;
+    }
+    if (dev->reconnect_failures >= RECONNECT_BREAKER_FAILURES) {
+        if (dev->reconnect_failures == RECONNECT_BREAKER_FAILURES) {
+            ESP_LOGW(TAG, "%s is gone; probing every %d s", dev->adv_name, RECONNECT_PROBE_MS / 1000);
+            dev->stats.breaker_trips++;
+        }
+        app_ble_dev_set_state(dev_index, BLE_DEV_STATE_IDLE);
+        delay_ms = RECONNECT_PROBE_MS;
+    } else {
+        app_ble_dev_set_state(dev_index, BLE_DEV_STATE_BACKOFF);
+        delay_ms = app_ble_backoff_ms(dev->reconnect_failures);
+        ESP_LOGI(TAG, "Reconnecting to %s in %u ms", dev->adv_name, delay_ms);
+    }
+    ble_npl_callout_reset(&dev->backoff_timer, ble_npl_time_ms_to_ticks32(delay_ms));
+}
+
+static void app_ble_backoff_timer_cb(struct ble_npl_event *ev)
+{
+    uint32_t dev_index = (uint32_t)ble_npl_event_get_arg(ev);
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    uint32_t delay_ms;
+    int i, connected = 0;
+
+    if (!dev->adv_name || dev->removing) {
+        return;
+    }
+    if (s_booting || dev->conn_handle != BLE_HS_CONN_HANDLE_NONE) {
+        if (dev->stats.state == BLE_DEV_STATE_BACKOFF) {
+            /* Still booting, or the failed link is not down yet */
+            ble_npl_callout_reset(&dev->backoff_timer,
+                    ble_npl_time_ms_to_ticks32(RECONNECT_BACKOFF_MIN_MS));
+        }
+        return;
+    }
+    for (i = 0; i < MAX_DEV; i++) {
+        if (s_ble_dev[i].conn_handle != BLE_HS_CONN_HANDLE_NONE) {
+            connected++;
+        }
+    }
+    if (connected >= MAX_CONN) {
+        /* Not worth disconnecting another device for. Tried again later, or sooner
+         * if written to. */
+        delay_ms = dev->reconnect_failures >= RECONNECT_BREAKER_FAILURES ?
+                RECONNECT_PROBE_MS : app_ble_backoff_ms(dev->reconnect_failures);
+        ble_npl_callout_reset(&dev->backoff_timer, ble_npl_time_ms_to_ticks32(delay_ms));
+        return;
+    }
+    app_ble_reconnect(dev_index);
+}
+
+/**
+ * Releases the UUIDs interned for the first count characteristics of a device
+ * that could not be added
+ */
+static void app_ble_add_dev_unwind(const int *svc_uuids, const int *chr_uuids, int count)
+{
+    int j;
+
+    portENTER_CRITICAL(&s_write_lock);
+    for (j = 0; j < count; j++) {
+        app_ble_uuid_release(svc_uuids[j]);
+        app_ble_uuid_release(chr_uuids[j]);
+    }
+    portEXIT_CRITICAL(&s_write_lock);
+}
 
 ble_dev_handle_t app_ble_add_dev(ble_cfg_t *cfg)
 {
-    int i;
-    if (!cfg->adv_name || !cfg->add) {
+    int svc_uuids[MAX_CHR], chr_uuids[MAX_CHR];
+    int i, j;
+    if (!cfg->adv_name || !cfg->add || !cfg->num_chrs || cfg->num_chrs > MAX_CHR) {
         ESP_LOGE(TAG, "Incorrect input");
-        return NULL;
+        return BLE_DEV_HANDLE_NONE;
+    }
+    for (j = 0; j < cfg->num_chrs; j++) {
+        if (!cfg->chrs[j].svc_uuid || !cfg->chrs[j].chr_uuid
+                || (cfg->chrs[j].subscribe && !cfg->notify)) {
+            ESP_LOGE(TAG, "Incorrect input");
+            return BLE_DEV_HANDLE_NONE;
+        }
+    }
+    for (j = 0; j < cfg->num_chrs; j++) {
+        portENTER_CRITICAL(&s_write_lock);
+        svc_uuids[j] = app_ble_uuid_intern(cfg->chrs[j].svc_uuid);
+        chr_uuids[j] = app_ble_uuid_intern(cfg->chrs[j].chr_uuid);
+        portEXIT_CRITICAL(&s_write_lock);
+        if (svc_uuids[j] < 0 || chr_uuids[j] < 0) {
+            ESP_LOGE(TAG, "UUID limit reached");
+            app_ble_add_dev_unwind(svc_uuids, chr_uuids, j + 1);
+            return BLE_DEV_HANDLE_NONE;
+        }
     }
 
+    /* The check and the claim are made under the same lock, so that two adds of
+     * the same instance cannot both get through */
+    portENTER_CRITICAL(&s_write_lock);
+    for (i = 0; i < MAX_DEV; i++) {
+        const char *name = s_ble_dev[i].adv_name ? s_ble_dev[i].adv_name : s_ble_dev[i].claim_name;
+
+        if (name && !s_ble_dev[i].removing && s_ble_dev[i].instance == cfg->instance
+                && strcmp(name, cfg->adv_name) == 0) {
+            break;
+        }
+    }
+    if (i < MAX_DEV) {
+        portEXIT_CRITICAL(&s_write_lock);
+        ESP_LOGE(TAG, "Instance %d of %s already registered", cfg->instance, cfg->adv_name);
+        app_ble_add_dev_unwind(svc_uuids, chr_uuids, cfg->num_chrs);
+        return BLE_DEV_HANDLE_NONE;
+    }
     for (i = 0; i < MAX_DEV; i++) {
-        if (!s_ble_dev[i].adv_name) {
-           break;
+        if (!(s_dev_claimed & (1 << i))) {
+            s_dev_claimed |= 1 << i;
+            s_ble_dev[i].claim_name = cfg->adv_name;
+            s_ble_dev[i].instance = cfg->instance;
+            break;
         }
     }
+    portEXIT_CRITICAL(&s_write_lock);
     if (i == MAX_DEV) {
         ESP_LOGE(TAG, "Max limit reached");
-        return NULL;
+        app_ble_add_dev_unwind(svc_uuids, chr_uuids, cfg->num_chrs);
+        return BLE_DEV_HANDLE_NONE;
     }
     ESP_LOGD(TAG, "Adding device at index %d", i);
-    s_ble_dev[i].adv_name = cfg->adv_name;
-    s_ble_dev[i].svc_uuid = cfg->svc_uuid;
-    s_ble_dev[i].chr_uuid = cfg->chr_uuid;
+    s_ble_dev[i].adv_name_len = strlen(cfg->adv_name);
+    for (j = 0; j < cfg->num_chrs; j++) {
+        s_ble_dev[i].chrs[j].svc_uuid = svc_uuids[j];
+        s_ble_dev[i].chrs[j].chr_uuid = chr_uuids[j];
+        s_ble_dev[i].chrs[j].subscribe = cfg->chrs[j].subscribe;
+        s_ble_dev[i].chrs[j].read_ttl_ms = cfg->chrs[j].read_ttl_ms ?
+                cfg->chrs[j].read_ttl_ms : READ_CACHE_TTL_MS;
+    }
+    s_ble_dev[i].num_chrs = cfg->num_chrs;
     s_ble_dev[i].add = cfg->add;
+    s_ble_dev[i].add_priv = cfg->priv;
+    s_ble_dev[i].notify = cfg->notify;
+    s_ble_dev[i].write_no_rsp = cfg->write_no_rsp;
+    s_ble_dev[i].priority = cfg->priority;
     s_ble_dev[i].conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    if (!s_ble_dev[i].generation) {
+        s_ble_dev[i].generation = 1;
+    }
+    if (s_started) {
+        s_ble_dev[i].hotplug = true;
+        if (app_ble_cache_get_addr(cfg->adv_name, cfg->instance, &s_ble_dev[i].stored_addr) == ESP_OK) {
+            s_ble_dev[i].has_stored_addr = true;
+            s_ble_dev[i].addr = s_ble_dev[i].stored_addr;
+            s_ble_dev[i].addr_valid = true;
+        }
+    }
+    app_latency_reset_dev(i, cfg->adv_name, cfg->instance);
+    /* The host task only looks at the slot once the name is set */
+    portENTER_CRITICAL(&s_write_lock);
+    s_ble_dev[i].adv_name = cfg->adv_name;
+    portEXIT_CRITICAL(&s_write_lock);
+    if (s_started) {
+        ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &s_registry_ev);
+    }
 
-    return (void *)&s_ble_dev[i];
+    return app_ble_dev_handle(&s_ble_dev[i]);
 }
 
 void ble_store_config_init(void);
 
+/**
+ * Ends the boot time discovery and unblocks app_ble_start()
+ */
+static void app_ble_boot_done(void)
+{
+    int i, registered = 0, added = 0;
+
+    if (!s_booting) {
+        return;
+    }
+    s_booting = false;
+    if (ble_gap_disc_active()) {
+        ble_gap_disc_cancel();
+    }
+    for (i = 0; i < MAX_DEV; i++) {
+        if (s_ble_dev[i].adv_name) {
+            registered++;
+            if (s_ble_dev[i].added) {
+                added++;
+            }
+            if (s_ble_dev[i].stats.state == BLE_DEV_STATE_SCANNING) {
+                /* Not found by the boot scan */
+                app_ble_dev_set_state(i, BLE_DEV_STATE_IDLE);
+            }
+        }
+    }
+    ESP_LOGI(TAG, "BLE discovery done in %d ms; %d of %d registered devices added",
+            (int)((esp_timer_get_time() - s_boot_start_time) / 1000), added, registered);
+    xSemaphoreGive(s_boot_sem);
+}
+
+/**
+ * Returns true if every registered device has been added to RainMaker
+ */
+static bool app_ble_all_added(void)
+{
+    int i;
+    for (i = 0; i < MAX_DEV; i++) {
+        if (s_ble_dev[i].adv_name && !s_ble_dev[i].added) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Loads the addresses of the devices being scanned for into the controller's
+ * filter accept list, so that other advertisers are dropped by the controller
+ * instead of waking up the host.
+ *
+ * An open scan is needed if any of the devices has no usable address. That is
+ * limited to the enrollment windows: the boot time discovery, where a device
+ * whose stored address did not work is looked up afresh, and a rescan for a
+ * device that has not been seen yet (or not found at its address last time).
+ *
+ * @param[in] reconnect Scan for the devices being reconnected rather than for all
+ *
+ * @return The filter policy to be used for the scan.
+ */
+static uint8_t app_ble_scan_filter_policy(bool reconnect)
+{
+    ble_addr_t addrs[MAX_DEV];
+    int i, rc, count = 0;
+
+    for (i = 0; i < MAX_DEV; i++) {
+        if (!s_ble_dev[i].adv_name || s_ble_dev[i].conn_handle != BLE_HS_CONN_HANDLE_NONE
+                || (reconnect && !s_ble_dev[i].reconnecting)) {
+            continue;
+        }
+        if (!s_ble_dev[i].addr_valid || (s_booting && s_ble_dev[i].direct_failed)) {
+            ESP_LOGD(TAG, "No usable address for %s, scanning for all devices",
+                    s_ble_dev[i].adv_name);
+            return BLE_HCI_SCAN_FILT_NO_WL;
+        }
+        addrs[count++] = s_ble_dev[i].addr;
+    }
+    if (count == 0) {
+        return BLE_HCI_SCAN_FILT_NO_WL;
+    }
+    rc = ble_gap_wl_set(addrs, count);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "Error setting the filter accept list; rc=%d", rc);
+        return BLE_HCI_SCAN_FILT_NO_WL;
+    }
+    return BLE_HCI_SCAN_FILT_USE_WL;
+}
+
 /**
  * Initiates the GAP general discovery procedure.
  */
-static void app_ble_scan(int type, const char *name)
+static void app_ble_scan(int type)
 {
     struct ble_gap_disc_params disc_params;
     uint8_t own_addr_type;
     int rc, duration_ms;
-    static int64_t time;
-
-    if (type == 0) {
-        /* First time */
-        duration_ms = SCAN_DURATION_MS;
-        time = esp_timer_get_time();
-    } else if (type == 1) {
-        /* Rescanning after starting RainMaker framework as the BLE accessory to be
-         * updated is not currently connected */
+
+    if (type == 1) {
+        /* Rescanning after starting RainMaker framework for the BLE accessories of
+         * the reconnection round, which are not currently connected */
         duration_ms = RESCAN_DURATION_MS;
     } else {
-        /* Rescanning to add a new registered device. This is done before starting
-         * the RainMaker framework */
-        duration_ms = SCAN_DURATION_MS - ((esp_timer_get_time() - time) / 1000);
+        /* Scanning to add the registered devices, in windows of SCAN_WINDOW_MS.
+         * This is done before starting the RainMaker framework */
+        duration_ms = SCAN_DURATION_MS - ((esp_timer_get_time() - s_boot_start_time) / 1000);
+        if (duration_ms > SCAN_WINDOW_MS) {
+            duration_ms = SCAN_WINDOW_MS;
+        }
     }
 
-    if (duration_ms < 0) {
-        duration_ms = 0;
+    if (duration_ms <= 0) {
+        /* Boot time discovery is over. Note that a duration of 0 would mean the
+         * stack default for ble_gap_disc(), so don't start a scan at all */
+        ESP_LOGI(TAG, "Scan duration elapsed");
+        app_ble_boot_done();
+        return;
     }
-    ESP_LOGI(TAG, "Starting scan for duration: %u", duration_ms);
     /* Figure out address to use while advertising (no privacy for now) */
     rc = ble_hs_id_infer_auto(0, &own_addr_type);
     if (rc != 0) {
@@ -117,308 +762,2128 @@ static void app_ble_scan(int type, const char *name)
     /* Use defaults for the rest of the parameters. */
     disc_params.itvl = 0;
     disc_params.window = 0;
-    disc_params.filter_policy = 0;
+    disc_params.filter_policy = app_ble_scan_filter_policy(type == 1);
     disc_params.limited = 0;
 
+    ESP_LOGI(TAG, "Starting %s scan for duration: %u",
+            disc_params.filter_policy == BLE_HCI_SCAN_FILT_USE_WL ? "filtered" : "open",
+            duration_ms);
+    s_scan_reconnect = (type == 1);
+    s_scan_accept_list = (disc_params.filter_policy == BLE_HCI_SCAN_FILT_USE_WL);
     rc = ble_gap_disc(own_addr_type, duration_ms, &disc_params,
-                      app_ble_gap_event, (void *)name);
+                      app_ble_gap_event, NULL);
     if (rc != 0) {
         ESP_LOGE(TAG, "Error initiating GAP discovery procedure; rc=%d", rc);
     }
 }
 
-static int app_ble_should_connect(const struct ble_gap_disc_desc *disc, uint32_t *dev_index)
+/**
+ * Adds a device to the 128-bit service UUID index, which is searched linearly
+ */
+static void app_ble_adv_index_add_uuid128(uint8_t uuid, int dev_index)
 {
-    struct ble_hs_adv_fields fields;
-    int rc;
+    int j;
 
-    /* The device has to be advertising connectability. */
-    if (disc->event_type != BLE_HCI_ADV_RPT_EVTYPE_ADV_IND &&
-            disc->event_type != BLE_HCI_ADV_RPT_EVTYPE_DIR_IND) {
+    for (j = 0; j < s_adv_uuid128_index_len; j++) {
+        if (s_adv_uuid128_index[j].uuid == uuid) {
+            break;
+        }
+    }
+    if (j == s_adv_uuid128_index_len) {
+        s_adv_uuid128_index[j].uuid = uuid;
+        s_adv_uuid128_index[j].dev_mask = 0;
+        s_adv_uuid128_index_len++;
+    }
+    s_adv_uuid128_index[j].dev_mask |= 1 << dev_index;
+}
 
-        return 0;
+/**
+ * Adds a device to the 16-bit service UUID index, which is kept sorted by UUID for
+ * a binary search
+ */
+static void app_ble_adv_index_add_uuid16(uint16_t uuid, int dev_index)
+{
+    int j;
+
+    for (j = 0; j < s_adv_uuid_index_len; j++) {
+        if (s_adv_uuid_index[j].uuid >= uuid) {
+            break;
+        }
+    }
+    if (j == s_adv_uuid_index_len || s_adv_uuid_index[j].uuid != uuid) {
+        memmove(&s_adv_uuid_index[j + 1], &s_adv_uuid_index[j],
+                (s_adv_uuid_index_len - j) * sizeof(s_adv_uuid_index[0]));
+        s_adv_uuid_index[j].uuid = uuid;
+        s_adv_uuid_index[j].dev_mask = 0;
+        s_adv_uuid_index_len++;
+    }
+    s_adv_uuid_index[j].dev_mask |= 1 << dev_index;
+}
+
+/**
+ * Builds the indices used by app_ble_adv_match() from the registered devices
+ */
+static void app_ble_adv_index_build(void)
+{
+    int i, j;
+
+    const ble_uuid_t *uuid;
+
+    memset(s_adv_name_index, 0, sizeof(s_adv_name_index));
+    s_adv_uuid_index_len = 0;
+    s_adv_uuid128_index_len = 0;
+    for (i = 0; i < MAX_DEV; i++) {
+        if (!s_ble_dev[i].adv_name || s_ble_dev[i].removing) {
+            continue;
+        }
+        s_adv_name_index[ADV_NAME_BUCKET(s_ble_dev[i].adv_name[0])] |= 1 << i;
+        s_ble_dev[i].shared = false;
+        for (j = 0; j < MAX_DEV; j++) {
+            if (j != i && s_ble_dev[j].adv_name && !s_ble_dev[j].removing
+                    && strcmp(s_ble_dev[j].adv_name, s_ble_dev[i].adv_name) == 0) {
+                s_ble_dev[i].shared = true;
+                break;
+            }
+        }
+        for (j = 0; j < s_ble_dev[i].num_chrs; j++) {
+            uuid = UUID(s_ble_dev[i].chrs[j].svc_uuid);
+            if (uuid->type == BLE_UUID_TYPE_16) {
+                app_ble_adv_index_add_uuid16(ble_uuid_u16(uuid), i);
+            } else if (uuid->type == BLE_UUID_TYPE_128) {
+                app_ble_adv_index_add_uuid128(s_ble_dev[i].chrs[j].svc_uuid, i);
+            }
+        }
+    }
+}
+
+/**
+ * Extracts the name and 16/128-bit service UUIDs from advertising data in one pass
+ *
+ * @return 0 if the data is well formed, non-zero otherwise.
+ */
+static int app_ble_adv_parse(const uint8_t *data, uint8_t len, struct adv_info *info)
+{
+    uint8_t field_len, type;
+
+    memset(info, 0, sizeof(*info));
+    while (len > 1) {
+        field_len = data[0];
+        if (field_len == 0) {
+            /* Padding at the end */
+            break;
+        }
+        if (field_len >= len) {
+            return -1;
+        }
+        type = data[1];
+        switch (type) {
+        case ADV_TYPE_NAME_SHORT:
+        case ADV_TYPE_NAME_COMP:
+            info->name = &data[2];
+            info->name_len = field_len - 1;
+            break;
+        case ADV_TYPE_UUIDS16_INCOMP:
+        case ADV_TYPE_UUIDS16_COMP:
+            info->uuids16 = &data[2];
+            info->num_uuids16 = (field_len - 1) / 2;
+            break;
+        case ADV_TYPE_UUIDS128_INCOMP:
+        case ADV_TYPE_UUIDS128_COMP:
+            info->uuids128 = &data[2];
+            info->num_uuids128 = (field_len - 1) / 16;
+            break;
+        default:
+            break;
+        }
+        len -= field_len + 1;
+        data += field_len + 1;
+    }
+    return 0;
+}
+
+static uint32_t app_ble_adv_match_uuid16(uint16_t uuid)
+{
+    int lo = 0, hi = s_adv_uuid_index_len - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (s_adv_uuid_index[mid].uuid == uuid) {
+            return s_adv_uuid_index[mid].dev_mask;
+        } else if (s_adv_uuid_index[mid].uuid < uuid) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t app_ble_adv_match_uuid128(const uint8_t *uuid)
+{
+    int i;
+
+    for (i = 0; i < s_adv_uuid128_index_len; i++) {
+        if (memcmp(s_uuids[s_adv_uuid128_index[i].uuid].u128.value, uuid, 16) == 0) {
+            return s_adv_uuid128_index[i].dev_mask;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns the mask of registered devices that the advertisement could be from.
+ *
+ * Devices are matched by their registered name being a prefix of the advertised
+ * name. Advertisements without a name are matched by the advertised service UUIDs.
+ */
+static uint32_t app_ble_adv_match(const struct adv_info *info)
+{
+    uint32_t candidates, matched = 0;
+    int i;
+
+    if (info->name) {
+        if (!info->name_len) {
+            return 0;
+        }
+        candidates = s_adv_name_index[ADV_NAME_BUCKET(info->name[0])];
+        for (i = 0; candidates; i++, candidates >>= 1) {
+            if ((candidates & 1) && s_ble_dev[i].adv_name_len <= info->name_len
+                    && memcmp(info->name, s_ble_dev[i].adv_name, s_ble_dev[i].adv_name_len) == 0) {
+                matched |= 1 << i;
+            }
+        }
+        return matched;
+    }
+    for (i = 0; i < info->num_uuids16; i++) {
+        matched |= app_ble_adv_match_uuid16(info->uuids16[2 * i] | (info->uuids16[2 * i + 1] << 8));
+    }
+    for (i = 0; i < info->num_uuids128; i++) {
+        matched |= app_ble_adv_match_uuid128(&info->uuids128[16 * i]);
+    }
+    return matched;
+}
+
+/**
+ * Picks which of the matched devices an advertiser is. Instances of a model are
+ * told apart by address: the advertiser goes to the instance bound to its address
+ * (last seen or stored in NVS), else to an instance not bound to any address yet.
+ * A device that is the only one registered with its name takes any matching
+ * advertiser, as before.
+ *
+ * @return Index of the device, -1 if none of them should take the advertiser.
+ */
+static int app_ble_instance_match(uint32_t matched, const ble_addr_t *addr)
+{
+    struct ble_dev *dev;
+    int i, unbound = -1, single = -1;
+
+    for (i = 0; matched; i++, matched >>= 1) {
+        if (!(matched & 1)) {
+            continue;
+        }
+        dev = &s_ble_dev[i];
+        if ((dev->addr_valid && ble_addr_cmp(&dev->addr, addr) == 0)
+                || (dev->has_stored_addr && ble_addr_cmp(&dev->stored_addr, addr) == 0)) {
+            return i;
+        }
+        if (!dev->addr_valid && !dev->has_stored_addr) {
+            if (unbound < 0) {
+                unbound = i;
+            }
+        } else if (!dev->shared && single < 0 && dev->conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+            single = i;
+        }
+    }
+    return unbound >= 0 ? unbound : single;
+}
+
+/**
+ * Classifies an advertisement report. Reports from anything other than a
+ * connectable registered device are dropped before any copying or logging.
+ *
+ * @return 1 if the advertiser should be connected to (dev_index is populated),
+ * 0 otherwise.
+ */
+static int app_ble_should_connect(const struct ble_gap_disc_desc *disc, uint32_t *dev_index)
+{
+    struct adv_info info;
+    struct ble_dev *dev;
+    int i;
+
+    /* The device has to be advertising connectability. */
+    if (disc->event_type != BLE_HCI_ADV_RPT_EVTYPE_ADV_IND &&
+            disc->event_type != BLE_HCI_ADV_RPT_EVTYPE_DIR_IND) {
+
+        return 0;
+    }
+
+    if (app_ble_adv_parse(disc->data, disc->length_data, &info) != 0) {
+        return 0;
+    }
+    i = app_ble_instance_match(app_ble_adv_match(&info), &disc->addr);
+    if (i < 0 || s_ble_dev[i].conn_handle != BLE_HS_CONN_HANDLE_NONE) {
+        return 0;
+    }
+    dev = &s_ble_dev[i];
+    app_trace_record(APP_TRACE_ADV, i, 0, disc->rssi);
+    /* Remember where the device was last seen, even if this scan is
+     * not looking for it, so that it can be connected to directly */
+    dev->addr = disc->addr;
+    dev->addr_valid = true;
+    dev->direct_failed = false;
+    if (dev->reconnect_failures >= RECONNECT_BREAKER_FAILURES && !dev->reconnecting) {
+        ESP_LOGI(TAG, "%s is back", dev->adv_name);
+        dev->reconnect_failures = 0;
+        app_ble_backoff(i);
+    }
+    /* A reconnection scan only connects to the devices of the round. The others
+     * are only remembered. */
+    if (dev->connect_pending || (s_scan_reconnect && !dev->reconnecting)) {
+        return 0;
+    }
+    *dev_index = i;
+    return 1;
+}
+
+/**
+ * Formats a BLE address into buf, which should hold at least ADDR_STR_LEN bytes
+ */
+static char *addr_str(const void *addr, char *buf)
+{
+    const uint8_t *u8p;
+
+    u8p = addr;
+    snprintf(buf, ADDR_STR_LEN, "%02x:%02x:%02x:%02x:%02x:%02x",
+            u8p[5], u8p[4], u8p[3], u8p[2], u8p[1], u8p[0]);
+
+    return buf;
+}
+
+/**
+ * Returns true if every registered device that the current scan is looking for
+ * is either connected or already queued for connection.
+ */
+static bool app_ble_all_found(void)
+{
+    int i;
+    for (i = 0; i < MAX_DEV; i++) {
+        if (!s_ble_dev[i].adv_name || s_ble_dev[i].conn_handle != BLE_HS_CONN_HANDLE_NONE
+                || s_ble_dev[i].connect_pending) {
+            continue;
+        }
+        if (!s_scan_reconnect || s_ble_dev[i].reconnecting) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Continues after the connection pipeline has drained. During boot, scanning is
+ * resumed for the remaining scan duration so that the registered devices not
+ * found so far still get a chance. Afterwards, the reconnections requested in the
+ * meantime are started.
+ */
+static void app_ble_scan_resume(void)
+{
+    if (s_booting) {
+        app_ble_scan(2);
+    } else {
+        app_ble_reconnect_run();
+    }
+}
+
+/**
+ * Handles a failed connection attempt. If the device was connected to directly, by
+ * its known address, it is scanned for instead, with an open scan since the
+ * address may have changed.
+ */
+static void app_ble_connect_failed(uint32_t dev_index, int status)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+
+    if (dev->direct_connect) {
+        /* Also makes the boot scan that follows the direct connections an open one */
+        dev->direct_failed = true;
+    }
+    if (dev->direct_connect && s_booting && !dev->reconnecting) {
+        /* Found by the boot scan that follows the direct connections */
+        ESP_LOGI(TAG, "Direct connection to %s failed; scanning for it", dev->adv_name);
+        app_ble_dev_set_state(dev_index, BLE_DEV_STATE_IDLE);
+        app_ble_dev_set_state(dev_index, BLE_DEV_STATE_SCANNING);
+    } else if (dev->direct_connect && dev->reconnecting) {
+        ESP_LOGI(TAG, "Direct connection to %s failed; rescanning", dev->adv_name);
+        dev->reconnecting = false;
+        /* Retried by the scan started once the connection pipeline has drained */
+        dev->reconnect_wanted = true;
+        app_ble_dev_set_state(dev_index, BLE_DEV_STATE_IDLE);
+    } else {
+        app_ble_dev_set_state(dev_index, BLE_DEV_STATE_IDLE);
+        app_ble_reconnect_done(dev_index, status);
+    }
+    dev->direct_connect = false;
+}
+
+/**
+ * Checks if a connection can be initiated without exceeding MAX_CONN. If not, the
+ * idle connected device with the lowest priority, least recently used amongst
+ * equals, is disconnected to make room.
+ *
+ * @return true if a connection can be initiated right away, false if it has to
+ * wait for a disconnection.
+ */
+static bool app_ble_conn_pool_reserve(void)
+{
+    int i, victim = -1, connected = 0;
+    struct ble_dev *dev;
+
+    for (i = 0; i < MAX_DEV; i++) {
+        dev = &s_ble_dev[i];
+        if (dev->conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+            continue;
+        }
+        connected++;
+        if (dev->evicting) {
+            /* Already making room */
+            return false;
+        }
+        if (!dev->ready || dev->write_in_flight || dev->write_pending_mask) {
+            continue;
+        }
+        if (victim < 0 || dev->priority < s_ble_dev[victim].priority
+                || (dev->priority == s_ble_dev[victim].priority
+                    && dev->last_used < s_ble_dev[victim].last_used)) {
+            victim = i;
+        }
+    }
+    if (connected < MAX_CONN) {
+        return true;
+    }
+    if (victim < 0) {
+        /* Every connected device is busy. Try again once some are done. */
+        ble_npl_callout_reset(&s_conn_pool_timer, ble_npl_time_ms_to_ticks32(CONN_POOL_RETRY_MS));
+        return false;
+    }
+    dev = &s_ble_dev[victim];
+    ESP_LOGI(TAG, "Disconnecting %s to make room for another device", dev->adv_name);
+    if (ble_gap_terminate(dev->conn_handle, BLE_ERR_REM_USER_CONN_TERM) != 0) {
+        ble_npl_callout_reset(&s_conn_pool_timer, ble_npl_time_ms_to_ticks32(CONN_POOL_RETRY_MS));
+        return false;
+    }
+    dev->evicting = true;
+    dev->stats.conn_evictions++;
+    return false;
+}
+
+static void app_ble_conn_pool_timer_cb(struct ble_npl_event *ev)
+{
+    int i;
+
+    for (i = 0; i < MAX_DEV; i++) {
+        if (s_ble_dev[i].connect_pending) {
+            app_ble_connect_next();
+            return;
+        }
+    }
+}
+
+/**
+ * Returns the class of the most urgent write pending for the device, WRITE_PRIO_MAX
+ * if none
+ */
+static int app_ble_write_prio(struct ble_dev *dev)
+{
+    int prio = WRITE_PRIO_MAX;
+
+    portENTER_CRITICAL(&s_write_lock);
+    if (dev->write_pending_mask) {
+        prio = dev->write_pending[app_ble_write_next(dev)].prio;
+    }
+    portEXIT_CRITICAL(&s_write_lock);
+    return prio;
+}
+
+/**
+ * Picks the next device to connect to amongst the queued ones: the one with the
+ * most urgent pending write, the devices of a class taking turns from the one
+ * connected last. Devices without writes (being found for the first time) come last.
+ *
+ * @return Index of the device, -1 if none is queued.
+ */
+static int app_ble_connect_pick(void)
+{
+    int prio, next = -1, next_prio = WRITE_PRIO_MAX + 1;
+    uint32_t i, n;
+
+    for (n = 1; n <= MAX_DEV; n++) {
+        i = (s_connect_last + n) % MAX_DEV;
+        if (!s_ble_dev[i].connect_pending) {
+            continue;
+        }
+        prio = app_ble_write_prio(&s_ble_dev[i]);
+        if (prio < next_prio) {
+            next = i;
+            next_prio = prio;
+        }
+    }
+    return next;
+}
+
+/**
+ * Connects to the next advertiser collected during the scan window.
+ *
+ * The host allows only one connection to be initiated at a time, so the queued
+ * advertisers are connected back to back: this is called again from the
+ * BLE_GAP_EVENT_CONNECT handler, while service discovery on the newly established
+ * link carries on in parallel.
+ */
+static void app_ble_connect_next(void)
+{
+    char addr[ADDR_STR_LEN];
+    uint8_t own_addr_type;
+    int rc, i;
+
+    if (ble_gap_conn_active()) {
+        return;
+    }
+
+    /* Figure out address to use for connect (no privacy for now) */
+    rc = ble_hs_id_infer_auto(0, &own_addr_type);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "Error determining address type; rc=%d", rc);
+        return;
+    }
+
+    while ((i = app_ble_connect_pick()) >= 0) {
+        if (!app_ble_conn_pool_reserve()) {
+            /* Carried on once a connection has been freed */
+            return;
+        }
+        s_ble_dev[i].connect_pending = false;
+        s_connect_last = i;
+        rc = ble_gap_connect(own_addr_type, &s_ble_dev[i].addr,
+                         s_ble_dev[i].direct_connect ? DIRECT_CONNECT_TIMEOUT_MS : CONNECT_TIMEOUT_MS,
+                         NULL, app_ble_gap_event, (void *)i);
+        if (rc == 0) {
+            s_ble_dev[i].connecting = true;
+            app_ble_dev_set_state(i, BLE_DEV_STATE_CONNECTING);
+            return;
+        }
+        ESP_LOGE(TAG, "Failed to connect to device; addr_type=%d addr=%s; rc=%d",
+                s_ble_dev[i].addr.type, addr_str(s_ble_dev[i].addr.val, addr), rc);
+        app_ble_connect_failed(i, rc);
+    }
+    /* Nothing left to connect */
+    app_ble_scan_resume();
+}
+
+static void app_ble_connect_if_interesting(const struct ble_gap_disc_desc *disc)
+{
+    int rc;
+    uint32_t dev_index = 0xff;
+
+    /* Don't do anything if we don't care about this advertiser. */
+    if (!app_ble_should_connect(disc, &dev_index)) {
+        return;
+    }
+
+    /* Queue it for connection. The scan carries on so that the other registered
+     * devices can be collected in the same window. */
+    s_ble_dev[dev_index].connect_pending = true;
+    ESP_LOGD(TAG, "Queued %s for connection", s_ble_dev[dev_index].adv_name);
+
+    if (!app_ble_all_found()) {
+        return;
+    }
+    /* Everything we are looking for has been seen. Scanning must be stopped
+     * before a connection can be initiated. */
+    rc = ble_gap_disc_cancel();
+    if (rc != 0) {
+        ESP_LOGD(TAG, "Failed to cancel scan; rc=%d", rc);
+        return;
+    }
+    app_ble_connect_next();
+}
+
+/**
+ * Marks the device ready once its characteristics are known, either by discovery
+ * or from the handle cache. The device is added to RainMaker the first time.
+ */
+static void app_ble_disc_done(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    char uuid[BLE_UUID_STR_LEN];
+    struct ble_dev_chr *chr;
+    int i;
+
+    for (i = 0; i < dev->num_chrs; i++) {
+        chr = &dev->chrs[i];
+        chr->write_no_rsp = dev->write_no_rsp;
+        if (chr->write_no_rsp && chr->val_handle
+                && !(chr->properties & BLE_GATT_CHR_PROP_WRITE_NO_RSP)) {
+            ESP_LOGW(TAG, "Characteristic %s of %s does not support write without response",
+                    uuid_str(chr->chr_uuid, uuid), dev->adv_name);
+            chr->write_no_rsp = false;
+        }
+    }
+    dev->no_rsp_credits = WRITE_NO_RSP_CREDITS;
+    dev->ready = true;
+    app_ble_dev_set_state(dev_index, BLE_DEV_STATE_READY);
+    if (dev->reconnecting) {
+        /* Repopulated for reconnection, or found after being added at runtime */
+        app_ble_reconnect_done(dev_index, 0);
+    }
+    if (!dev->added) {
+        dev->add(dev->add_priv);
+        dev->added = true;
+        ESP_LOGI(TAG, "Added BLE device %s", dev->adv_name);
+        /* No need to wait for the scan duration to elapse if everything
+         * registered is already attached */
+        if (app_ble_all_added()) {
+            app_ble_boot_done();
+        }
+    }
+    if (dev->write_pending_mask) {
+        ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &dev->write_ev);
+    }
+}
+
+/**
+ * Stores the discovered handles of the device, along with its Database Hash (if any)
+ */
+static void app_ble_cache_store(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    ble_handle_cache_t cache = {
+        .num_chrs = dev->num_chrs,
+        .has_db_hash = dev->has_db_hash,
+    };
+    int i;
+
+    for (i = 0; i < dev->num_chrs; i++) {
+        ble_uuid_copy(&cache.chrs[i].svc_uuid, UUID(dev->chrs[i].svc_uuid));
+        ble_uuid_copy(&cache.chrs[i].chr_uuid, UUID(dev->chrs[i].chr_uuid));
+        cache.chrs[i].val_handle = dev->chrs[i].val_handle;
+        cache.chrs[i].properties = dev->chrs[i].properties;
+        cache.chrs[i].end_handle = dev->chrs[i].end_handle;
+        cache.chrs[i].cccd_handle = dev->chrs[i].cccd_handle;
+    }
+    memcpy(cache.db_hash, dev->db_hash, sizeof(cache.db_hash));
+    if (app_ble_cache_set_handles(&dev->addr, &cache) == ESP_OK) {
+        ESP_LOGD(TAG, "Cached GATT handles of %s", dev->adv_name);
+    }
+}
+
+/**
+ * Drops the cached handles of the device and rediscovers them on the current link
+ */
+static void app_ble_cache_invalidate(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+
+    ESP_LOGW(TAG, "Cached GATT handles of %s are stale; rediscovering", dev->adv_name);
+    app_ble_cache_erase_handles(&dev->addr);
+    dev->ready = false;
+    app_ble_dev_set_state(dev_index, BLE_DEV_STATE_DISCOVERING);
+    app_ble_discover(dev_index);
+}
+
+/**
+ * Populates the device from the handle cache, if it has an entry for the device
+ * that was discovered for the same services and characteristics.
+ */
+static bool app_ble_cache_load(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    ble_handle_cache_t cache;
+    int i;
+
+    if (app_ble_cache_get_handles(&dev->addr, &cache) != ESP_OK
+            || cache.num_chrs != dev->num_chrs) {
+        return false;
+    }
+    for (i = 0; i < dev->num_chrs; i++) {
+        if (ble_uuid_cmp(&cache.chrs[i].svc_uuid.u, UUID(dev->chrs[i].svc_uuid)) != 0
+                || ble_uuid_cmp(&cache.chrs[i].chr_uuid.u, UUID(dev->chrs[i].chr_uuid)) != 0) {
+            return false;
+        }
+    }
+    for (i = 0; i < dev->num_chrs; i++) {
+        dev->chrs[i].val_handle = cache.chrs[i].val_handle;
+        dev->chrs[i].properties = cache.chrs[i].properties;
+        dev->chrs[i].end_handle = cache.chrs[i].end_handle;
+        dev->chrs[i].cccd_handle = cache.chrs[i].cccd_handle;
+    }
+    dev->has_db_hash = cache.has_db_hash;
+    memcpy(dev->db_hash, cache.db_hash, sizeof(dev->db_hash));
+    dev->handles_cached = true;
+    return true;
+}
+
+/**
+ * Database Hash read callback. After discovery, the hash is stored along with the
+ * handles. When cached handles are in use, it is compared against the cached one
+ * to detect a changed GATT database.
+ */
+static int app_ble_on_db_hash(uint16_t conn_handle, const struct ble_gatt_error *error,
+                 struct ble_gatt_attr *attr, void *arg)
+{
+    uint32_t dev_index = (uint32_t)arg;
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    uint8_t hash[GATT_DB_HASH_LEN];
+    uint16_t len = 0;
+
+    if (dev->db_hash_mismatch) {
+        /* The handles are being rediscovered, and cached once that is done */
+        if (error->status != 0) {
+            dev->db_hash_mismatch = false;
+        }
+        return 0;
+    }
+    if (error->status == 0 && attr) {
+        ble_hs_mbuf_to_flat(attr->om, hash, sizeof(hash), &len);
+        if (len != sizeof(hash)) {
+            return 0;
+        }
+        if (!dev->handles_cached) {
+            dev->has_db_hash = true;
+            memcpy(dev->db_hash, hash, sizeof(hash));
+        } else if (!dev->has_db_hash || memcmp(dev->db_hash, hash, sizeof(hash)) != 0) {
+            dev->db_hash_mismatch = true;
+            app_ble_cache_invalidate(dev_index);
+        } else {
+            ESP_LOGD(TAG, "GATT database of %s unchanged", dev->adv_name);
+        }
+        return 0;
+    }
+    /* Anything other than the end of the read or an ATT error (the peer does not
+     * expose a Database Hash) says nothing about the handles, e.g. a lost link */
+    if (error->status != BLE_HS_EDONE && (error->status <= BLE_HS_ERR_ATT_BASE
+                || error->status >= BLE_HS_ERR_ATT_BASE + 0x100)) {
+        ESP_LOGD(TAG, "Database Hash read of %s failed; status=%d", dev->adv_name, error->status);
+        return 0;
+    }
+    if (!dev->handles_cached) {
+        app_ble_cache_store(dev_index);
+    } else if (dev->has_db_hash && error->status != BLE_HS_EDONE) {
+        /* Exposed when the handles were cached, but no longer */
+        app_ble_cache_invalidate(dev_index);
+    }
+    return 0;
+}
+
+static void app_ble_read_db_hash(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    int rc;
+
+    rc = ble_gattc_read_by_uuid(dev->conn_handle, 1, 0xffff, BLE_UUID16_DECLARE(GATT_DB_HASH_UUID16),
+            app_ble_on_db_hash, (void *)dev_index);
+    if (rc != 0) {
+        ESP_LOGD(TAG, "Failed to read Database Hash; rc=%d", rc);
+    }
+}
+
+/**
+ * Handles a failure to set up a connection. The link is of no use without the
+ * characteristics, so it is dropped and brought up again after a backoff.
+ */
+static void app_ble_setup_failed(uint32_t dev_index, int status)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+
+    app_ble_reconnect_done(dev_index, status);
+    if (dev->conn_handle != BLE_HS_CONN_HANDLE_NONE) {
+        ble_gap_terminate(dev->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+    }
+}
+
+static int app_disc_chr_cb(uint16_t conn_handle, const struct ble_gatt_error *error,
+            const struct ble_gatt_chr *chr, void *arg)
+{
+    uint32_t dev_index = (uint32_t)arg;
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    char uuid[BLE_UUID_STR_LEN];
+    int i;
+
+    if (error && error->status == 0) {
+        if (chr) {
+            /* Match by UUID within the services the characteristics were
+             * registered for */
+            for (i = 0; i < dev->num_chrs; i++) {
+                if (dev->chrs[i].val_handle && chr->def_handle > dev->chrs[i].val_handle
+                        && chr->def_handle <= dev->chrs[i].end_handle) {
+                    /* The next characteristic ends the previous one */
+                    dev->chrs[i].end_handle = chr->def_handle - 1;
+                }
+                if (ble_uuid_cmp(UUID(dev->chrs[i].chr_uuid), &chr->uuid.u) == 0
+                        && chr->def_handle >= dev->chrs[i].svc_start_handle
+                        && chr->def_handle <= dev->chrs[i].svc_end_handle) {
+                    dev->chrs[i].val_handle = chr->val_handle;
+                    dev->chrs[i].properties = chr->properties;
+                    dev->chrs[i].end_handle = dev->chrs[i].svc_end_handle;
+                    ESP_LOGD(TAG, "Characteristic %s value handle: %u",
+                            uuid_str(dev->chrs[i].chr_uuid, uuid), chr->val_handle);
+                }
+            }
+        }
+    }
+    if (error && error->status == BLE_HS_EDONE) {
+        for (i = 0; i < dev->num_chrs; i++) {
+            if (!dev->chrs[i].val_handle) {
+                ESP_LOGE(TAG, "Characteristic %s not found on %s",
+                        uuid_str(dev->chrs[i].chr_uuid, uuid), dev->adv_name);
+            }
+        }
+        app_ble_disc_done(dev_index);
+        app_ble_subscribe(dev_index);
+    } else if (error && error->status != 0) {
+        ESP_LOGE(TAG, "Characteristic discovery failed; status=%d", error->status);
+        app_ble_setup_failed(dev_index, error->status);
+    }
+    return 0;
+}
+
+static int app_disc_svc_cb(uint16_t conn_handle, const struct ble_gatt_error *error,
+            const struct ble_gatt_svc *service, void *arg)
+{
+    uint32_t dev_index = (uint32_t)arg;
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    uint16_t start = 0xffff, end = 0;
+    int i, rc;
+
+    if (error && error->status == 0) {
+        if (service) {
+            for (i = 0; i < dev->num_chrs; i++) {
+                if (ble_uuid_cmp(UUID(dev->chrs[i].svc_uuid), &service->uuid.u) == 0) {
+                    dev->chrs[i].svc_start_handle = service->start_handle;
+                    dev->chrs[i].svc_end_handle = service->end_handle;
+                }
+            }
+            ESP_LOGD(TAG, "Service start handle: %u end handle: %u", service->start_handle, service->end_handle);
+        }
+    }
+    if (error && error->status == BLE_HS_EDONE) {
+        /* The characteristics of all the services of interest are discovered
+         * together, over the range spanning them */
+        for (i = 0; i < dev->num_chrs; i++) {
+            if (!dev->chrs[i].svc_end_handle) {
+                continue;
+            }
+            if (dev->chrs[i].svc_start_handle < start) {
+                start = dev->chrs[i].svc_start_handle;
+            }
+            if (dev->chrs[i].svc_end_handle > end) {
+                end = dev->chrs[i].svc_end_handle;
+            }
+        }
+        if (!end) {
+            ESP_LOGE(TAG, "Services not found on %s", dev->adv_name);
+            app_ble_setup_failed(dev_index, BLE_HS_ENOENT);
+            return 0;
+        }
+        rc = ble_gattc_disc_all_chrs(conn_handle, start, end, app_disc_chr_cb, (void *)dev_index);
+        if (rc != 0) {
+            ESP_LOGE(TAG, "Failed to start characteristic discovery; rc=%d", rc);
+            app_ble_setup_failed(dev_index, rc);
+        }
+    } else if (error && error->status != 0) {
+        ESP_LOGE(TAG, "Service discovery failed; status=%d", error->status);
+        app_ble_setup_failed(dev_index, error->status);
+    }
+    return 0;
+}
+
+/**
+ * Discovers the services and characteristics of the device on its connection, in
+ * a single pass over all the services followed by a single pass over the
+ * characteristics of the ones of interest.
+ */
+static void app_ble_discover(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    int i, rc;
+
+    dev->handles_cached = false;
+    for (i = 0; i < dev->num_chrs; i++) {
+        dev->chrs[i].svc_start_handle = 0;
+        dev->chrs[i].svc_end_handle = 0;
+        dev->chrs[i].val_handle = 0;
+        dev->chrs[i].properties = 0;
+        dev->chrs[i].end_handle = 0;
+        dev->chrs[i].cccd_handle = 0;
+    }
+    rc = ble_gattc_disc_all_svcs(dev->conn_handle, app_disc_svc_cb, (void *)dev_index);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "Failed to start service discovery; rc=%d", rc);
+        app_ble_setup_failed(dev_index, rc);
+    }
+}
+
+/**
+ * Completes the setup of a connection once the subscriptions are done. With
+ * freshly discovered handles, the Database Hash is read to cache them for the
+ * next connection. With cached handles, it is read to check that they still apply.
+ */
+static void app_ble_subscribe_done(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    int i;
+
+    if (dev->handles_cached) {
+        if (dev->has_db_hash) {
+            app_ble_read_db_hash(dev_index);
+        }
+        return;
+    }
+    for (i = 0; i < dev->num_chrs; i++) {
+        if (dev->chrs[i].val_handle) {
+            dev->has_db_hash = false;
+            app_ble_read_db_hash(dev_index);
+            return;
+        }
+    }
+}
+
+static void app_ble_subscribe_next(uint32_t dev_index);
+
+static int app_ble_on_cccd_write(uint16_t conn_handle, const struct ble_gatt_error *error,
+                 struct ble_gatt_attr *attr, void *arg)
+{
+    uint32_t dev_index = (uint32_t)arg;
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    char uuid[BLE_UUID_STR_LEN];
+
+    if (error->status != 0) {
+        ESP_LOGE(TAG, "Failed to subscribe to %s of %s; status=%d",
+                uuid_str(dev->chrs[dev->subscribe_index].chr_uuid, uuid), dev->adv_name, error->status);
+    }
+    dev->subscribe_index++;
+    app_ble_subscribe_next(dev_index);
+    return 0;
+}
+
+/**
+ * Enables notifications (or indications, if that is all the characteristic
+ * supports) by writing the Client Characteristic Configuration Descriptor
+ */
+static int app_ble_write_cccd(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    struct ble_dev_chr *chr = &dev->chrs[dev->subscribe_index];
+    uint8_t value[2] = {0};
+
+    value[0] = (chr->properties & BLE_GATT_CHR_PROP_NOTIFY) ? 0x01 : 0x02;
+    return ble_gattc_write_flat(dev->conn_handle, chr->cccd_handle, value, sizeof(value),
+            app_ble_on_cccd_write, (void *)dev_index);
+}
+
+static int app_disc_dsc_cb(uint16_t conn_handle, const struct ble_gatt_error *error,
+            uint16_t chr_val_handle, const struct ble_gatt_dsc *dsc, void *arg)
+{
+    uint32_t dev_index = (uint32_t)arg;
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    char uuid[BLE_UUID_STR_LEN];
+    struct ble_dev_chr *chr = &dev->chrs[dev->subscribe_index];
+
+    if (error->status == 0 && dsc) {
+        if (ble_uuid_cmp(&dsc->uuid.u, BLE_UUID16_DECLARE(BLE_GATT_DSC_CLT_CFG_UUID16)) == 0) {
+            chr->cccd_handle = dsc->handle;
+        }
+        return 0;
+    }
+    if (error->status == BLE_HS_EDONE && chr->cccd_handle && app_ble_write_cccd(dev_index) == 0) {
+        return 0;
+    }
+    ESP_LOGE(TAG, "Failed to subscribe to %s of %s; status=%d",
+            uuid_str(chr->chr_uuid, uuid), dev->adv_name, error->status);
+    dev->subscribe_index++;
+    app_ble_subscribe_next(dev_index);
+    return 0;
+}
+
+/**
+ * Subscribes to the next characteristic configured for it, one at a time. The
+ * CCCD is discovered first, unless its handle is already known.
+ */
+static void app_ble_subscribe_next(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    char uuid[BLE_UUID_STR_LEN];
+    struct ble_dev_chr *chr;
+    int rc;
+
+    for (; dev->subscribe_index < dev->num_chrs; dev->subscribe_index++) {
+        chr = &dev->chrs[dev->subscribe_index];
+        if (!chr->subscribe || !chr->val_handle) {
+            continue;
+        }
+        if (!(chr->properties & (BLE_GATT_CHR_PROP_NOTIFY | BLE_GATT_CHR_PROP_INDICATE))) {
+            ESP_LOGW(TAG, "Characteristic %s of %s does not support notifications",
+                    uuid_str(chr->chr_uuid, uuid), dev->adv_name);
+            continue;
+        }
+        if (chr->cccd_handle) {
+            rc = app_ble_write_cccd(dev_index);
+        } else {
+            rc = ble_gattc_disc_all_dscs(dev->conn_handle, chr->val_handle, chr->end_handle,
+                    app_disc_dsc_cb, (void *)dev_index);
+        }
+        if (rc == 0) {
+            return;
+        }
+        ESP_LOGE(TAG, "Failed to subscribe to %s of %s; rc=%d",
+                uuid_str(chr->chr_uuid, uuid), dev->adv_name, rc);
+    }
+    app_ble_subscribe_done(dev_index);
+}
+
+/**
+ * Subscribes to the characteristics configured for it, once the handles are known
+ */
+static void app_ble_subscribe(uint32_t dev_index)
+{
+    s_ble_dev[dev_index].subscribe_index = 0;
+    app_ble_subscribe_next(dev_index);
+}
+
+/**
+ * Passes the held back notified values of the device to the accessory, for the
+ * characteristics whose NOTIFY_MIN_INTERVAL_MS has elapsed. notify_timer is armed
+ * for the rest.
+ */
+static void app_ble_notify_flush(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    struct ble_dev_chr *chr;
+    int64_t now = esp_timer_get_time();
+    uint32_t elapsed_ms, wait_ms = 0;
+    int i;
+
+    for (i = 0; i < dev->num_chrs; i++) {
+        chr = &dev->chrs[i];
+        if (!chr->notify_pending) {
+            continue;
+        }
+        elapsed_ms = (now - chr->notify_last) / 1000;
+        if (!chr->notify_last || elapsed_ms >= NOTIFY_MIN_INTERVAL_MS) {
+            chr->notify_pending = false;
+            chr->notify_last = now;
+            dev->notify(app_ble_dev_handle(dev), i, chr->notify_data, chr->notify_len);
+        } else if (!wait_ms || NOTIFY_MIN_INTERVAL_MS - elapsed_ms < wait_ms) {
+            wait_ms = NOTIFY_MIN_INTERVAL_MS - elapsed_ms;
+        }
+    }
+    if (wait_ms && !ble_npl_callout_is_active(&dev->notify_timer)) {
+        ble_npl_callout_reset(&dev->notify_timer, ble_npl_time_ms_to_ticks32(wait_ms));
+    }
+}
+
+static void app_ble_notify_timer_cb(struct ble_npl_event *ev)
+{
+    app_ble_notify_flush((uint32_t)ble_npl_event_get_arg(ev));
+}
+
+/**
+ * Handles a notification or indication received from a device, for a
+ * characteristic that was subscribed to
+ */
+static void app_ble_on_notify(uint32_t i, uint16_t conn_handle, uint16_t attr_handle,
+        struct os_mbuf *om)
+{
+    struct ble_dev_chr *chr;
+    uint16_t len;
+    int j;
+
+    if (!s_ble_dev[i].adv_name || s_ble_dev[i].removing
+            || s_ble_dev[i].conn_handle != conn_handle) {
+        return;
+    }
+    for (j = 0; j < s_ble_dev[i].num_chrs; j++) {
+        chr = &s_ble_dev[i].chrs[j];
+        if (!chr->subscribe || chr->val_handle != attr_handle) {
+            continue;
+        }
+        s_ble_dev[i].stats.notifies_received++;
+        if (chr->notify_pending) {
+            s_ble_dev[i].stats.notifies_dropped++;
+        }
+        if (ble_hs_mbuf_to_flat(om, chr->notify_data, sizeof(chr->notify_data), &len) != 0) {
+            ESP_LOGE(TAG, "Notified value of %s too long", s_ble_dev[i].adv_name);
+            chr->notify_pending = false;
+            return;
+        }
+        chr->notify_len = len;
+        chr->notify_pending = true;
+        if (len <= sizeof(chr->read_data)) {
+            /* The notified value is the current one, as good as a read */
+            memcpy(chr->read_data, chr->notify_data, len);
+            chr->read_len = len;
+            chr->read_time = esp_timer_get_time();
+            chr->read_valid = true;
+        }
+        app_ble_notify_flush(i);
+        return;
+    }
+}
+
+/**
+ * The nimble host executes this callback when a GAP event occurs.  The
+ * application associates a GAP event callback with each connection that is
+ * established.  app_ble uses the same callback for all connections.
+ *
+ * @param event                 The event being signalled.
+ * @param arg                   Application-specified argument; unused by
+ *                                  app_ble.
+ *
+ * @return                      0 if the application successfully handled the
+ *                                  event; nonzero on failure.  The semantics
+ *                                  of the return code is specific to the
+ *                                  particular GAP event being signalled.
+ */
+static int app_ble_gap_event(struct ble_gap_event *event, void *arg)
+{
+    struct ble_gap_conn_desc desc;
+    int rc, i;
+    uint32_t dev_index = (uint32_t)arg;
+    switch (event->type) {
+    case BLE_GAP_EVENT_DISC:
+        /* An advertisement report was received during GAP discovery.
+         * Try to connect to the advertiser if it looks interesting. */
+        app_ble_connect_if_interesting(&event->disc);
+        return 0;
+
+    case BLE_GAP_EVENT_CONNECT:
+        /* A new connection was established or a connection attempt failed. */
+        s_ble_dev[dev_index].connecting = false;
+        app_trace_record(APP_TRACE_CONNECT, dev_index, event->connect.conn_handle,
+                event->connect.status);
+        if (event->connect.status == 0 && s_ble_dev[dev_index].removing) {
+            /* Removed while connecting. Freed once disconnected. */
+            s_ble_dev[dev_index].conn_handle = event->connect.conn_handle;
+            app_ble_dev_teardown(dev_index);
+        } else if (event->connect.status == 0) {
+            /* Connection successfully established. */
+            s_ble_dev[dev_index].conn_handle = event->connect.conn_handle;
+            s_ble_dev[dev_index].direct_connect = false;
+            s_ble_dev[dev_index].direct_failed = false;
+            s_ble_dev[dev_index].addr_valid = true;
+            s_ble_dev[dev_index].last_used = esp_timer_get_time();
+            app_ble_store_addr(dev_index);
+            app_ble_dev_set_state(dev_index, BLE_DEV_STATE_DISCOVERING);
+
+            if (app_ble_cache_load(dev_index)) {
+                /* Skip discovery. The writes go to the cached handles right away,
+                 * while the Database Hash (if any) is checked in the background. */
+                ESP_LOGI(TAG, "Using cached GATT handles of %s", s_ble_dev[dev_index].adv_name);
+                app_ble_disc_done(dev_index);
+                app_ble_subscribe(dev_index);
+            } else {
+                app_ble_discover(dev_index);
+            }
+        } else {
+            app_ble_connect_failed(dev_index, event->connect.status);
+            if (s_ble_dev[dev_index].removing) {
+                app_ble_dev_free(dev_index);
+            }
+        }
+        /* Move on to the next queued advertiser (if any) */
+        app_ble_connect_next();
+        return 0;
+
+    case BLE_GAP_EVENT_DISCONNECT:
+        /* Connection terminated. */
+        app_trace_record(APP_TRACE_DISCONNECT, dev_index, event->disconnect.conn.conn_handle,
+                event->disconnect.reason);
+        s_ble_dev[dev_index].conn_handle = BLE_HS_CONN_HANDLE_NONE;
+        s_ble_dev[dev_index].ready = false;
+        if (s_ble_dev[dev_index].removing) {
+            app_ble_dev_free(dev_index);
+        } else if (s_ble_dev[dev_index].evicting) {
+            app_ble_dev_set_state(dev_index, BLE_DEV_STATE_IDLE);
+        } else if (s_ble_dev[dev_index].stats.state != BLE_DEV_STATE_BACKOFF) {
+            /* Lost the link. It is brought back up in the background, so that the
+             * next write finds it up rather than waiting for a rescan. */
+            app_ble_backoff(dev_index);
+        }
+        if (s_ble_dev[dev_index].evicting || !s_ble_dev[dev_index].adv_name) {
+            s_ble_dev[dev_index].evicting = false;
+            /* Room has been made for a device waiting to be connected */
+            app_ble_connect_next();
+        }
+        return 0;
+
+    case BLE_GAP_EVENT_DISC_COMPLETE:
+        app_trace_record(APP_TRACE_SCAN_DONE, APP_TRACE_DEV_NONE, 0, event->disc_complete.reason);
+        if (!s_booting) {
+            /* The rescan ended without finding some of the devices of the round.
+             * The ones found are connected next. */
+            for (i = 0; i < MAX_DEV; i++) {
+                if (s_ble_dev[i].reconnecting && !s_ble_dev[i].connect_pending
+                        && s_ble_dev[i].conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+                    if (s_scan_accept_list) {
+                        /* Not found at the known address. The next scan for it
+                         * will be an open one. */
+                        s_ble_dev[i].addr_valid = false;
+                    }
+                    app_ble_reconnect_done(i, BLE_HS_ETIMEOUT);
+                }
+            }
+            app_ble_connect_next();
+            return 0;
+        }
+        /* End of a boot time scan window. Connect to whatever was collected and
+         * then resume scanning, if required. */
+        app_ble_connect_next();
+        return 0;
+
+    case BLE_GAP_EVENT_ENC_CHANGE:
+        /* Encryption has been enabled or disabled for this connection. */
+        app_trace_record(APP_TRACE_ENC_CHANGE, dev_index, event->enc_change.conn_handle,
+                event->enc_change.status);
+        return 0;
+
+    case BLE_GAP_EVENT_NOTIFY_RX:
+        /* Peer sent us a notification or indication. */
+        app_trace_record(APP_TRACE_NOTIFY, dev_index, event->notify_rx.attr_handle,
+                event->notify_rx.indication);
+        /* Delivered to the callback of the connection, whose argument is the device */
+        app_ble_on_notify(dev_index, event->notify_rx.conn_handle, event->notify_rx.attr_handle,
+                event->notify_rx.om);
+        return 0;
+
+    case BLE_GAP_EVENT_MTU:
+        app_trace_record(APP_TRACE_MTU, dev_index, event->mtu.conn_handle, event->mtu.value);
+        return 0;
+
+    case BLE_GAP_EVENT_REPEAT_PAIRING:
+        /* We already have a bond with the peer, but it is attempting to
+         * establish a new secure link.  This app sacrifices security for
+         * convenience: just throw away the old bond and accept the new link.
+         */
+
+        /* Delete the old bond. */
+        rc = ble_gap_conn_find(event->repeat_pairing.conn_handle, &desc);
+        assert(rc == 0);
+        ble_store_util_delete_peer(&desc.peer_id_addr);
+
+        /* Return BLE_GAP_REPEAT_PAIRING_RETRY to indicate that the host should
+         * continue with the pairing operation.
+         */
+        return BLE_GAP_REPEAT_PAIRING_RETRY;
+
+    default:
+        return 0;
+    }
+}
+
+static int app_ble_chr_on_write(uint16_t conn_handle, const struct ble_gatt_error *error,
+                 struct ble_gatt_attr *attr, void *arg)
+{
+    uint32_t dev_index = (uint32_t)arg;
+
+    app_trace_record(APP_TRACE_WRITE_RSP, dev_index, attr ? attr->handle : 0, error->status);
+    if (s_ble_dev[dev_index].handles_cached && error->status > BLE_HS_ERR_ATT_BASE
+            && error->status < BLE_HS_ERR_ATT_BASE + 0x100) {
+        /* ATT error on a cached handle. Rediscover and then retry the write. */
+        app_ble_write_retry(dev_index);
+        app_ble_cache_invalidate(dev_index);
+        return 0;
+    }
+    /* The peer has processed everything sent before this write */
+    s_ble_dev[dev_index].no_rsp_credits = WRITE_NO_RSP_CREDITS;
+    app_ble_write_complete(dev_index, error->status);
+    app_ble_write_process(dev_index);
+    return 0;
+}
+
+/**
+ * Accounts for a write entering or leaving the pending slots of a device.
+ * Should be called with s_write_lock held.
+ */
+static void app_ble_sched_enqueue(uint8_t prio)
+{
+    if (++s_sched_stats.queue_depth[prio] > s_sched_stats.queue_depth_max[prio]) {
+        s_sched_stats.queue_depth_max[prio] = s_sched_stats.queue_depth[prio];
+    }
+}
+
+static void app_ble_sched_dequeue(uint8_t prio)
+{
+    s_sched_stats.queue_depth[prio]--;
+}
+
+/**
+ * Reports the status of the write in flight and frees the in flight slot
+ */
+static void app_ble_write_complete(uint32_t dev_index, int status)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    int64_t now = esp_timer_get_time();
+
+    dev->write_in_flight = false;
+    if (dev->write_inflight.om) {
+        /* Not handed to the host */
+        os_mbuf_free_chain(dev->write_inflight.om);
+        dev->write_inflight.om = NULL;
+    }
+    if (status != 0 && status != WRITE_COALESCED) {
+        ESP_LOGE(TAG, "Write to %s failed; status=%d", dev->adv_name, status);
+        dev->stats.writes_failed++;
+    } else if (status == 0) {
+        /* The value read earlier no longer holds */
+        dev->chrs[dev->write_inflight.chr_index].read_valid = false;
+        app_latency_record(dev_index, APP_LATENCY_ATT, now - dev->write_inflight.sent);
+        app_latency_count(dev_index, dev->write_inflight.len);
+    }
+    app_trace_record(APP_TRACE_WRITE_DONE, dev_index, dev->write_inflight.chr_index, status);
+    if (dev->write_inflight.cb) {
+        dev->write_inflight.cb(app_ble_dev_handle(dev), status, dev->write_inflight.priv);
+    }
+    if (status == 0) {
+        /* The callback reports the new value to RainMaker */
+        app_latency_record(dev_index, APP_LATENCY_REPORT, esp_timer_get_time() - now);
+        app_latency_record(dev_index, APP_LATENCY_TOTAL,
+                esp_timer_get_time() - dev->write_inflight.received);
+    }
+}
+
+/**
+ * Puts the write in flight back into the pending slot, to be sent again once the
+ * device is ready. If a newer write is already pending, that one is sent instead.
+ */
+static void app_ble_write_retry(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    uint8_t chr_index = dev->write_inflight.chr_index;
+    bool coalesced;
+
+    portENTER_CRITICAL(&s_write_lock);
+    coalesced = dev->write_pending_mask & (1 << chr_index);
+    if (!coalesced) {
+        dev->write_pending[chr_index] = dev->write_inflight;
+        dev->write_pending_mask |= 1 << chr_index;
+        app_ble_sched_enqueue(dev->write_inflight.prio);
+    }
+    portEXIT_CRITICAL(&s_write_lock);
+    if (coalesced) {
+        dev->stats.writes_coalesced++;
+        app_ble_write_complete(dev_index, WRITE_COALESCED);
+    }
+    dev->write_in_flight = false;
+}
+
+/**
+ * Fails the pending writes of the device to the characteristics in chr_mask, if any
+ */
+static void app_ble_write_fail_pending(uint32_t dev_index, uint8_t chr_mask, int status)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    bool has_pending;
+    int i;
+
+    if (dev->write_in_flight) {
+        /* The in flight slot is needed to report the status. The pending writes
+         * will be handled once the current one completes. */
+        return;
+    }
+    for (i = 0; i < dev->num_chrs; i++) {
+        if (!(chr_mask & (1 << i))) {
+            continue;
+        }
+        portENTER_CRITICAL(&s_write_lock);
+        has_pending = dev->write_pending_mask & (1 << i);
+        if (has_pending) {
+            dev->write_inflight = dev->write_pending[i];
+            dev->write_pending_mask &= ~(1 << i);
+            app_ble_sched_dequeue(dev->write_inflight.prio);
+        }
+        portEXIT_CRITICAL(&s_write_lock);
+        if (has_pending) {
+            app_ble_write_complete(dev_index, status);
+        }
+    }
+}
+
+/**
+ * Sends the write in flight as a write command (without response), if the device
+ * is configured for it and flow control allows. The write is completed right away.
+ *
+ * Write commands are not acknowledged by the peer and would queue up in the host
+ * if sent faster than the link drains them. So a device gets WRITE_NO_RSP_CREDITS
+ * write commands, after which an acknowledged write is sent to confirm the state
+ * and restore the credits. An acknowledged write is also used whenever the host is
+ * running short of mbufs.
+ *
+ * @return 0 if the write was sent, non-zero if an acknowledged write should be used.
+ */
+static int app_ble_write_no_rsp(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    struct ble_dev_chr *chr = &dev->chrs[dev->write_inflight.chr_index];
+    int rc;
+
+    if (!chr->write_no_rsp || !dev->no_rsp_credits
+            || os_msys_num_free() < WRITE_NO_RSP_MIN_FREE_MBUFS) {
+        return 1;
+    }
+    if (dev->write_inflight.om) {
+        /* The host takes the mbuf even if it fails to send it. Keep a copy to fall
+         * back to an acknowledged write with. */
+        os_mbuf_copydata(dev->write_inflight.om, 0, dev->write_inflight.len,
+                dev->write_inflight.data);
+        rc = ble_gattc_write_no_rsp(dev->conn_handle, chr->val_handle, dev->write_inflight.om);
+        dev->write_inflight.om = NULL;
+    } else {
+        rc = ble_gattc_write_no_rsp_flat(dev->conn_handle, chr->val_handle,
+                dev->write_inflight.data, dev->write_inflight.len);
+    }
+    if (rc != 0) {
+        ESP_LOGD(TAG, "Failed to write characteristic without response; rc=%d", rc);
+        dev->no_rsp_credits = 0;
+        return rc;
+    }
+    dev->no_rsp_credits--;
+    dev->stats.writes_sent++;
+    dev->stats.writes_no_rsp++;
+    app_ble_write_complete(dev_index, 0);
+    return 0;
+}
+
+/**
+ * Returns the index of the characteristic with the most urgent pending write: the
+ * one of the highest priority class, the oldest amongst equals.
+ * Should be called with s_write_lock held and at least one write pending.
+ */
+static int app_ble_write_next(struct ble_dev *dev)
+{
+    struct ble_write *pending = dev->write_pending;
+    int i, next = -1;
+
+    for (i = 0; i < dev->num_chrs; i++) {
+        if (!(dev->write_pending_mask & (1 << i))) {
+            continue;
+        }
+        if (next < 0 || pending[i].prio < pending[next].prio
+                || (pending[i].prio == pending[next].prio
+                    && pending[i].submitted < pending[next].submitted)) {
+            next = i;
+        }
+    }
+    return next;
+}
+
+/**
+ * Sends the pending writes for the device, most urgent first, if it is connected.
+ * Otherwise, a rescan is initiated and the writes stay pending until the device
+ * is back or their deadlines expire. Always runs in the NimBLE host task.
+ */
+static void app_ble_write_process(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    char uuid[BLE_UUID_STR_LEN];
+    struct ble_dev_chr *chr;
+    int64_t now, deadline;
+    uint8_t expired;
+    int rc, i, next;
+
+    if (dev->removing) {
+        /* Failed once the device is freed */
+        return;
+    }
+    while (!dev->write_in_flight) {
+        now = esp_timer_get_time();
+        portENTER_CRITICAL(&s_write_lock);
+        if (!dev->write_pending_mask) {
+            portEXIT_CRITICAL(&s_write_lock);
+            ble_npl_callout_stop(&dev->write_timer);
+            return;
+        }
+        /* Every pending write is checked, not just the next one: a write behind a
+         * more urgent one may be the first to expire */
+        expired = 0;
+        deadline = INT64_MAX;
+        for (i = 0; i < dev->num_chrs; i++) {
+            if (!(dev->write_pending_mask & (1 << i))) {
+                continue;
+            }
+            if (now >= dev->write_pending[i].deadline) {
+                expired |= 1 << i;
+                dev->stats.writes_expired++;
+                s_sched_stats.deadline_misses[dev->write_pending[i].prio]++;
+            } else if (dev->write_pending[i].deadline < deadline) {
+                deadline = dev->write_pending[i].deadline;
+            }
+        }
+        if (!expired && dev->ready) {
+            next = app_ble_write_next(dev);
+            dev->write_inflight = dev->write_pending[next];
+            dev->write_pending_mask &= ~(1 << next);
+            dev->write_in_flight = true;
+            dev->last_used = now;
+            app_ble_sched_dequeue(dev->write_inflight.prio);
+        }
+        portEXIT_CRITICAL(&s_write_lock);
+
+        if (expired) {
+            app_ble_write_fail_pending(dev_index, expired, BLE_HS_ETIMEOUT);
+            continue;
+        }
+        if (!dev->write_in_flight) {
+            /* Woken up by the earliest deadline amongst the pending writes */
+            app_ble_reconnect(dev_index);
+            ble_npl_callout_reset(&dev->write_timer,
+                    ble_npl_time_ms_to_ticks32((deadline - now) / 1000 + 1));
+            return;
+        }
+        if (!dev->write_inflight.sent) {
+            /* Not a retry (see app_ble_write_retry()) */
+            dev->write_inflight.sent = now;
+            app_latency_record(dev_index, APP_LATENCY_QUEUE, now - dev->write_inflight.submitted);
+        }
+        chr = &dev->chrs[dev->write_inflight.chr_index];
+        if (!chr->val_handle) {
+            ESP_LOGE(TAG, "Characteristic %s of %s not available", uuid_str(chr->chr_uuid, uuid), dev->adv_name);
+            app_ble_write_complete(dev_index, BLE_HS_ENOENT);
+            continue;
+        }
+        if (app_ble_write_no_rsp(dev_index) == 0) {
+            continue;
+        }
+        if (dev->write_inflight.om) {
+            if (dev->handles_cached) {
+                /* Keep a copy to retry with, should the cached handle turn out
+                 * to be stale (see app_ble_chr_on_write()) */
+                os_mbuf_copydata(dev->write_inflight.om, 0, dev->write_inflight.len,
+                        dev->write_inflight.data);
+            }
+            rc = ble_gattc_write(dev->conn_handle, chr->val_handle, dev->write_inflight.om,
+                    app_ble_chr_on_write, (void *)dev_index);
+            dev->write_inflight.om = NULL;
+        } else {
+            rc = ble_gattc_write_flat(dev->conn_handle, chr->val_handle,
+                    dev->write_inflight.data, dev->write_inflight.len,
+                    app_ble_chr_on_write, (void *)dev_index);
+        }
+        if (rc != 0) {
+            ESP_LOGE(TAG, "Failed to write characteristic; rc=%d", rc);
+            app_ble_write_complete(dev_index, rc);
+            continue;
+        }
+        dev->stats.writes_sent++;
+    }
+}
+
+static void app_ble_write_ev_cb(struct ble_npl_event *ev)
+{
+    app_ble_write_process((uint32_t)ble_npl_event_get_arg(ev));
+}
+
+/**
+ * Reports the status (and value, on success) of a characteristic to all the
+ * readers waiting for it
+ */
+static void app_ble_read_complete(uint32_t dev_index, uint8_t chr_index, int status)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    struct ble_dev_chr *chr = &dev->chrs[chr_index];
+    struct ble_read_waiter done[MAX_READ_WAITERS];
+    int i, num_done = 0, num_left = 0;
+
+    portENTER_CRITICAL(&s_write_lock);
+    for (i = 0; i < dev->num_read_waiters; i++) {
+        if (dev->read_waiters[i].chr_index == chr_index) {
+            done[num_done++] = dev->read_waiters[i];
+        } else {
+            dev->read_waiters[num_left++] = dev->read_waiters[i];
+        }
     }
+    dev->num_read_waiters = num_left;
+    portEXIT_CRITICAL(&s_write_lock);
 
-    rc = ble_hs_adv_parse_fields(&fields, disc->data, disc->length_data);
-    if (rc != 0) {
-        return rc;
+    if (status != 0) {
+        dev->stats.reads_failed += num_done;
     }
+    for (i = 0; i < num_done; i++) {
+        done[i].cb(app_ble_dev_handle(dev), chr_index, status, status == 0 ? chr->read_data : NULL,
+                status == 0 ? chr->read_len : 0, done[i].priv);
+    }
+}
 
-    char s[BLE_HS_ADV_MAX_SZ];
+static int app_ble_on_read(uint16_t conn_handle, const struct ble_gatt_error *error,
+                 struct ble_gatt_attr *attr, void *arg)
+{
+    uint32_t dev_index = (uint32_t)arg & 0xff;
+    uint8_t chr_index = (uint32_t)arg >> 8;
+    struct ble_dev_chr *chr = &s_ble_dev[dev_index].chrs[chr_index];
+    int status = error->status;
+    uint16_t len;
     int i;
-    memcpy(s, fields.name, fields.name_len);
-    s[fields.name_len] = '\0';
+
+    chr->read_in_flight = false;
+    s_reads_in_flight--;
+    if (status == 0 && attr) {
+        if (ble_hs_mbuf_to_flat(attr->om, chr->read_data, sizeof(chr->read_data), &len) == 0) {
+            chr->read_len = len;
+            chr->read_time = esp_timer_get_time();
+            chr->read_valid = true;
+        } else {
+            ESP_LOGE(TAG, "Value read from %s too long", s_ble_dev[dev_index].adv_name);
+            status = BLE_HS_EMSGSIZE;
+        }
+    }
+    app_ble_read_complete(dev_index, chr_index, status);
+
+    /* Give the reads held back for MAX_READS_IN_FLIGHT a chance */
     for (i = 0; i < MAX_DEV; i++) {
-        if (s_ble_dev[i].adv_name) {
-            if (strncmp((const char *)s, s_ble_dev[i].adv_name, strlen(s_ble_dev[i].adv_name)) == 0
-                    && (s_ble_dev[i].conn_handle == BLE_HS_CONN_HANDLE_NONE)) {
-                *dev_index = i;
-                return 1;
-            }
+        if (s_ble_dev[i].num_read_waiters) {
+            ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &s_ble_dev[i].read_ev);
         }
     }
     return 0;
 }
 
-static char *addr_str(const void *addr)
+/**
+ * Serves the readers waiting for the device, from the cache if the value is
+ * recent enough. Otherwise, an ATT read is sent, unless one is already in flight
+ * for the characteristic or MAX_READS_IN_FLIGHT reads are in flight overall.
+ * Always runs in the NimBLE host task.
+ */
+static void app_ble_read_process(uint32_t dev_index)
 {
-    static char buf[6 * 2 + 5 + 1];
-    const uint8_t *u8p;
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    struct ble_dev_chr *chr;
+    int64_t now = esp_timer_get_time();
+    uint8_t waiting = 0;
+    int i, rc;
 
-    u8p = addr;
-    sprintf(buf, "%02x:%02x:%02x:%02x:%02x:%02x",
-            u8p[5], u8p[4], u8p[3], u8p[2], u8p[1], u8p[0]);
+    portENTER_CRITICAL(&s_write_lock);
+    for (i = 0; i < dev->num_read_waiters; i++) {
+        waiting |= 1 << dev->read_waiters[i].chr_index;
+    }
+    portEXIT_CRITICAL(&s_write_lock);
 
-    return buf;
+    for (i = 0; i < dev->num_chrs; i++) {
+        if (!(waiting & (1 << i))) {
+            continue;
+        }
+        chr = &dev->chrs[i];
+        if (chr->read_valid && (now - chr->read_time) / 1000 < chr->read_ttl_ms) {
+            dev->stats.read_cache_hits++;
+            app_ble_read_complete(dev_index, i, 0);
+            continue;
+        }
+        if (chr->read_in_flight) {
+            /* Its result will be shared */
+            continue;
+        }
+        if (!dev->ready) {
+            app_ble_read_complete(dev_index, i, BLE_HS_ENOTCONN);
+            continue;
+        }
+        if (!chr->val_handle) {
+            app_ble_read_complete(dev_index, i, BLE_HS_ENOENT);
+            continue;
+        }
+        if (s_reads_in_flight >= MAX_READS_IN_FLIGHT) {
+            /* Retried once a read completes */
+            continue;
+        }
+        rc = ble_gattc_read(dev->conn_handle, chr->val_handle, app_ble_on_read,
+                (void *)(dev_index | (i << 8)));
+        if (rc != 0) {
+            ESP_LOGE(TAG, "Failed to read characteristic; rc=%d", rc);
+            app_ble_read_complete(dev_index, i, rc);
+            continue;
+        }
+        chr->read_in_flight = true;
+        s_reads_in_flight++;
+        dev->stats.reads_sent++;
+    }
 }
 
-static void app_ble_connect_if_interesting(const struct ble_gap_disc_desc *disc)
+static void app_ble_read_ev_cb(struct ble_npl_event *ev)
 {
-    uint8_t own_addr_type;
-    int rc;
-    uint32_t dev_index = 0xff;
+    app_ble_read_process((uint32_t)ble_npl_event_get_arg(ev));
+}
 
-    /* Don't do anything if we don't care about this advertiser. */
-    if (!app_ble_should_connect(disc, &dev_index)) {
+/**
+ * Stores the address of a connected device in NVS, if it has changed
+ */
+static void app_ble_store_addr(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+
+    if (dev->has_stored_addr && ble_addr_cmp(&dev->stored_addr, &dev->addr) == 0) {
         return;
     }
+    if (app_ble_cache_set_addr(dev->adv_name, dev->instance, &dev->addr) == ESP_OK) {
+        dev->stored_addr = dev->addr;
+        dev->has_stored_addr = true;
+    }
+}
 
-    /* Scanning must be stopped before a connection can be initiated. */
-    rc = ble_gap_disc_cancel();
-    if (rc != 0) {
-        ESP_LOGD(TAG, "Failed to cancel scan; rc=%d", rc);
+/**
+ * Requests a reconnection to a device that has writes waiting for it. Requests are
+ * served in rounds by app_ble_reconnect_run(), so that the devices disconnected at
+ * the same time share a single scan instead of taking turns. A device requested
+ * while an open reconnection scan is in progress joins it right away.
+ */
+static void app_ble_reconnect(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+
+    if (s_booting || dev->removing || dev->reconnecting || dev->conn_handle != BLE_HS_CONN_HANDLE_NONE) {
         return;
     }
-
-    /* Figure out address to use for connect (no privacy for now) */
-    rc = ble_hs_id_infer_auto(0, &own_addr_type);
-    if (rc != 0) {
-        ESP_LOGE(TAG, "Error determining address type; rc=%d", rc);
+    if (!dev->reconnect_start_time) {
+        dev->reconnect_start_time = esp_timer_get_time();
+    }
+    if (ble_gap_disc_active() && s_scan_reconnect && !s_scan_accept_list) {
+        ESP_LOGD(TAG, "%s joins the scan in progress", dev->adv_name);
+        dev->reconnecting = true;
+        app_ble_dev_set_state(dev_index, BLE_DEV_STATE_SCANNING);
         return;
     }
+    dev->reconnect_wanted = true;
+    app_ble_reconnect_run();
+}
 
-    /* Save addr in dev_index */
-    s_ble_dev[dev_index].addr = disc->addr;
+/**
+ * Starts a reconnection round for the devices requested with app_ble_reconnect(),
+ * once the GAP procedures are free. The devices with a known address are connected
+ * to directly, back to back. The rest (including the ones whose direct connection
+ * fails) are then looked for by one scan, which ends as soon as all of them are
+ * found, and are connected back to back as well.
+ */
+static void app_ble_reconnect_run(void)
+{
+    char addr[ADDR_STR_LEN];
+    struct ble_dev *dev;
+    bool direct = false, scan = false;
+    uint32_t i;
 
-    /* Try to connect the the advertiser.  Allow 30 seconds (30000 ms) for
-     * timeout.
-     */
-    if (s_ble_dev[dev_index].conn_handle == BLE_HS_CONN_HANDLE_NONE) {
-        rc = ble_gap_connect(own_addr_type, &disc->addr, 30000, NULL,
-                         app_ble_gap_event, (void *)dev_index);
-        if (rc != 0) {
-            ESP_LOGE(TAG, "Failed to connect to device; addr_type=%d addr=%s; rc=%d",
-                disc->addr.type, addr_str(disc->addr.val), rc);
+    if (s_booting || ble_gap_disc_active() || ble_gap_conn_active()) {
+        return;
+    }
+    for (i = 0; i < MAX_DEV; i++) {
+        if (s_ble_dev[i].connect_pending) {
+            /* The connection pipeline has not drained yet (waiting for room in the
+             * pool). It comes back here once it has. */
             return;
         }
     }
-}
-
-static int app_disc_chr_cb(uint16_t conn_handle, const struct ble_gatt_error *error,
-            const struct ble_gatt_chr *chr, void *arg)
-{
-    uint32_t dev_index = (uint32_t)arg;
-    if (error && error->status == 0) {
-        if (chr) {
-            s_ble_dev[dev_index].chr = *chr;
-            ESP_LOGD(TAG, "Characteristic value handle: %u", s_ble_dev[dev_index].chr.val_handle);
+    for (i = 0; i < MAX_DEV; i++) {
+        dev = &s_ble_dev[i];
+        if (!dev->reconnect_wanted) {
+            continue;
         }
-    }
-    if (error && error->status == BLE_HS_EDONE) {
-        if (!s_ble_dev[dev_index].reconnect) {
-            s_ble_dev[dev_index].add();
-            ESP_LOGI(TAG, "Added BLE device %s", s_ble_dev[dev_index].adv_name);
+        if (dev->removing || dev->conn_handle != BLE_HS_CONN_HANDLE_NONE) {
+            dev->reconnect_wanted = false;
+            continue;
+        }
+        if (dev->addr_valid && !dev->direct_failed) {
+            ESP_LOGD(TAG, "Reconnecting to %s at %s", dev->adv_name, addr_str(dev->addr.val, addr));
+            dev->reconnect_wanted = false;
+            dev->reconnecting = true;
+            dev->direct_connect = true;
+            dev->connect_pending = true;
+            direct = true;
         } else {
-            /* Repopulated for reconnection */
-            xSemaphoreGive(s_sem);
+            scan = true;
         }
     }
-    return 0;
+    if (direct) {
+        /* The devices to be scanned for are taken up once these are done */
+        app_ble_connect_next();
+        return;
+    }
+    if (!scan) {
+        return;
+    }
+    for (i = 0; i < MAX_DEV; i++) {
+        dev = &s_ble_dev[i];
+        if (dev->reconnect_wanted) {
+            ESP_LOGD(TAG, "Rescanning for %s", dev->adv_name);
+            dev->reconnect_wanted = false;
+            dev->reconnecting = true;
+            app_ble_dev_set_state(i, BLE_DEV_STATE_SCANNING);
+        }
+    }
+    app_ble_scan(1);
 }
 
-static int app_disc_svc_cb(uint16_t conn_handle, const struct ble_gatt_error *error,
-            const struct ble_gatt_svc *service, void *arg)
+/**
+ * Completes a reconnection attempt. On failure, all the writes waiting for the
+ * device are failed with the given status. Other devices waiting for the GAP
+ * procedure to be free are then given a chance.
+ */
+static void app_ble_reconnect_done(uint32_t dev_index, int status)
 {
-    uint32_t dev_index = (uint32_t)arg;
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    uint32_t latency_ms;
 
-    if (error && error->status == 0) {
-        if (service) {
-            s_ble_dev[dev_index].svc = *service;
-            ESP_LOGD(TAG, "Service start handle: %u end handle: %u", s_ble_dev[dev_index].svc.start_handle, s_ble_dev[dev_index].svc.end_handle);
-        }
+    if (!dev->reconnecting) {
+        return;
     }
-    if (error && error->status == BLE_HS_EDONE) {
-            ble_gattc_disc_chrs_by_uuid(conn_handle, s_ble_dev[dev_index].svc.start_handle,
-                    s_ble_dev[dev_index].svc.end_handle, BLE_UUID16_DECLARE(s_ble_dev[dev_index].chr_uuid), app_disc_chr_cb, (void *)dev_index);
+    dev->reconnecting = false;
+    latency_ms = (esp_timer_get_time() - dev->reconnect_start_time) / 1000;
+    dev->reconnect_start_time = 0;
+    if (!dev->added) {
+        /* Looked for after being added at runtime, rather than reconnected */
+        ESP_LOGI(TAG, "%s %s", dev->adv_name, status == 0 ? "found" : "not found yet");
+        if (status != 0) {
+            app_ble_dev_set_state(dev_index, BLE_DEV_STATE_IDLE);
+        }
+    } else if (status != 0) {
+        ESP_LOGE(TAG, "Failed to reconnect to %s; status=%d", dev->adv_name, status);
+        dev->stats.reconnect_failures++;
+        app_ble_write_fail_pending(dev_index, 0xff, status);
+        if (dev->reconnect_failures < UINT8_MAX) {
+            dev->reconnect_failures++;
+        }
+        app_ble_backoff(dev_index);
+    } else {
+        dev->reconnect_failures = 0;
+        ESP_LOGI(TAG, "Reconnected to %s in %u ms", dev->adv_name, latency_ms);
+        dev->stats.reconnects++;
+        dev->stats.reconnect_last_ms = latency_ms;
+        dev->stats.reconnect_total_ms += latency_ms;
+        if (latency_ms > dev->stats.reconnect_max_ms) {
+            dev->stats.reconnect_max_ms = latency_ms;
+        }
     }
-    return 0;
+    /* Start the next round, if this one is over */
+    app_ble_reconnect_run();
 }
 
 /**
- * The nimble host executes this callback when a GAP event occurs.  The
- * application associates a GAP event callback with each connection that is
- * established.  app_ble uses the same callback for all connections.
- *
- * @param event                 The event being signalled.
- * @param arg                   Application-specified argument; unused by
- *                                  app_ble.
- *
- * @return                      0 if the application successfully handled the
- *                                  event; nonzero on failure.  The semantics
- *                                  of the return code is specific to the
- *                                  particular GAP event being signalled.
+ * Queues a write of either data (copied) or om (taken over), replacing the write
+ * pending for the characteristic, if any. The handle is checked with s_write_lock
+ * held, so that the write cannot land on a device removed in the meantime.
  */
-static int app_ble_gap_event(struct ble_gap_event *event, void *arg)
+static esp_err_t app_ble_write_queue(ble_dev_handle_t handle, uint8_t chr_index,
+        const uint8_t *data, struct os_mbuf *om, int len, const write_opts_t *opts,
+        write_done_func_t cb, void *priv)
 {
-    struct ble_gap_conn_desc desc;
-    struct ble_hs_adv_fields fields;
-    char s[BLE_HS_ADV_MAX_SZ];
-    int rc;
-    uint32_t dev_index = (uint32_t)arg;
-    switch (event->type) {
-    case BLE_GAP_EVENT_DISC:
-        rc = ble_hs_adv_parse_fields(&fields, event->disc.data,
-                                     event->disc.length_data);
-        if (rc != 0) {
-            return 0;
-        }
+    uint32_t timeout_ms = opts->timeout_ms ? opts->timeout_ms : WRITE_TIMEOUT_MS;
+    uint8_t prio = opts->prio;
+    int64_t now = esp_timer_get_time();
+    int64_t received = opts->received ? opts->received : now;
+    write_done_func_t coalesced_cb = NULL;
+    void *coalesced_priv = NULL;
+    struct os_mbuf *coalesced_om = NULL;
+    struct ble_write *pending;
+    struct ble_dev *dev;
 
-        /* An advertisement report was received during GAP discovery. */
-        if (fields.name != NULL) {
-            assert(fields.name_len < sizeof s - 1);
-            memcpy(s, fields.name, fields.name_len);
-            s[fields.name_len] = '\0';
-            ESP_LOGI(TAG, "Found a BLE device with %s name: %s",
-                    fields.name_is_complete ? "complete" : "incomplete", s);
-        }
-        const char *name = (char *)arg;
-        if (name) {
-            if (strncmp((const char *)s, name, strlen(name)) == 0) {
-                ESP_LOGD(TAG, "Reconnecting to %s", name);
-                /* Try to connect to the advertiser if it looks interesting. */
-                app_ble_connect_if_interesting(&event->disc);
-            }
-        } else {
-            app_ble_connect_if_interesting(&event->disc);
+    portENTER_CRITICAL(&s_write_lock);
+    dev = app_ble_dev_get(handle);
+    if (!dev || chr_index >= dev->num_chrs) {
+        portEXIT_CRITICAL(&s_write_lock);
+        return ESP_ERR_INVALID_ARG;
+    }
+    pending = &dev->write_pending[chr_index];
+    if (dev->write_pending_mask & (1 << chr_index)) {
+        /* Not sent yet, so just replace it. The new value carries the state the
+         * replaced one was meant to set, so it inherits its class if more urgent. */
+        coalesced_cb = pending->cb;
+        coalesced_priv = pending->priv;
+        coalesced_om = pending->om;
+        dev->stats.writes_coalesced++;
+        app_ble_sched_dequeue(pending->prio);
+        if (pending->prio < prio) {
+            prio = pending->prio;
         }
-        return 0;
+    }
+    pending->chr_index = chr_index;
+    pending->om = om;
+    if (!om) {
+        memcpy(pending->data, data, len);
+    }
+    pending->len = len;
+    pending->cb = cb;
+    pending->priv = priv;
+    pending->prio = prio;
+    pending->submitted = now;
+    pending->deadline = now + (int64_t)timeout_ms * 1000;
+    pending->received = received;
+    pending->sent = 0;
+    dev->write_pending_mask |= 1 << chr_index;
+    app_ble_sched_enqueue(prio);
+    dev->stats.writes_submitted++;
+    if (dev->ready) {
+        dev->stats.conn_hits++;
+    } else {
+        dev->stats.conn_misses++;
+    }
+    portEXIT_CRITICAL(&s_write_lock);
 
-    case BLE_GAP_EVENT_CONNECT:
-        /* A new connection was established or a connection attempt failed. */
-        if (event->connect.status == 0) {
-            /* Connection successfully established. */
-            ESP_LOGI(TAG, "BLE connection established");
-            s_ble_dev[dev_index].conn_handle = event->connect.conn_handle;
+    app_latency_record(DEV_HANDLE_INDEX(handle), APP_LATENCY_ACCEPT, now - received);
+    if (coalesced_om) {
+        os_mbuf_free_chain(coalesced_om);
+    }
+    if (coalesced_cb) {
+        coalesced_cb(handle, WRITE_COALESCED, coalesced_priv);
+    }
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &dev->write_ev);
+    return ESP_OK;
+}
+
+static const write_opts_t s_write_opts_default = {
+    .prio = WRITE_PRIO_INTERACTIVE,
+};
+
+esp_err_t app_ble_write_opts(ble_dev_handle_t dev, uint8_t chr_index, const uint8_t *data, int len,
+        const write_opts_t *opts, write_done_func_t cb, void *priv)
+{
+    if (!data || len <= 0 || len > MAX_WRITE_LEN || !opts || opts->prio >= WRITE_PRIO_MAX
+            || app_ble_write_queue(dev, chr_index, data, NULL, len, opts, cb, priv) != ESP_OK) {
+        ESP_LOGE(TAG, "Incorrect input");
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
 
-            ble_gattc_disc_svc_by_uuid(event->connect.conn_handle, BLE_UUID16_DECLARE(s_ble_dev[dev_index].svc_uuid),
-                    app_disc_svc_cb, (void *)dev_index);
+esp_err_t app_ble_write(ble_dev_handle_t dev, uint8_t chr_index, const uint8_t *data, int len,
+        write_done_func_t cb, void *priv)
+{
+    return app_ble_write_opts(dev, chr_index, data, len, &s_write_opts_default, cb, priv);
+}
+
+struct os_mbuf *app_ble_write_buf_get(ble_dev_handle_t handle)
+{
+    struct os_mbuf *om = NULL;
+    struct ble_dev *dev;
+    uint32_t num_free;
+
+    num_free = os_msys_num_free();
+    if (num_free > WRITE_BUF_MIN_FREE_MBUFS) {
+        om = ble_hs_mbuf_att_pkt();
+    }
+    portENTER_CRITICAL(&s_write_lock);
+    dev = app_ble_dev_get(handle);
+    if (dev) {
+        if (om) {
+            dev->stats.write_bufs++;
         } else {
-            ESP_LOGI(TAG, "Failed to establish BLE connection; status=%d", event->connect.status);
+            dev->stats.write_buf_failures++;
         }
-        if (!s_ble_dev[dev_index].reconnect) {
-            ESP_LOGD(TAG, "Restarting scan for reconnection");
-            app_ble_scan(2, NULL);
+        if (dev->stats.write_bufs + dev->stats.write_buf_failures == 1
+                || num_free < dev->stats.write_buf_min_free) {
+            dev->stats.write_buf_min_free = num_free;
         }
-        return 0;
-
-    case BLE_GAP_EVENT_DISCONNECT:
-        /* Connection terminated. */
-        ESP_LOGI(TAG, "BLE connection disconnected; reason=%d", event->disconnect.reason);
-        s_ble_dev[dev_index].conn_handle = BLE_HS_CONN_HANDLE_NONE;
-        return 0;
+    }
+    portEXIT_CRITICAL(&s_write_lock);
+    if (!dev && om) {
+        os_mbuf_free_chain(om);
+        om = NULL;
+    }
+    return om;
+}
 
-    case BLE_GAP_EVENT_DISC_COMPLETE:
-        ESP_LOGI(TAG, "Discovery complete; reason=%d", event->disc_complete.reason);
-        xSemaphoreGive(s_sem);
-        return 0;
+esp_err_t app_ble_write_mbuf_opts(ble_dev_handle_t dev, uint8_t chr_index, struct os_mbuf *om,
+        const write_opts_t *opts, write_done_func_t cb, void *priv)
+{
+    int len;
 
-    case BLE_GAP_EVENT_ENC_CHANGE:
-        /* Encryption has been enabled or disabled for this connection. */
-        ESP_LOGI(TAG, "Encryption change event; status=%d", event->enc_change.status);
-        return 0;
+    if (!om) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    len = OS_MBUF_PKTLEN(om);
+    if (len <= 0 || len > MAX_WRITE_LEN || !opts || opts->prio >= WRITE_PRIO_MAX
+            || app_ble_write_queue(dev, chr_index, NULL, om, len, opts, cb, priv) != ESP_OK) {
+        ESP_LOGE(TAG, "Incorrect input");
+        os_mbuf_free_chain(om);
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
 
-    case BLE_GAP_EVENT_NOTIFY_RX:
-        /* Peer sent us a notification or indication. */
-        ESP_LOGI(TAG, "received %s; conn_handle=%d attr_handle=%d "
-                    "attr_len=%d",
-                    event->notify_rx.indication ?
-                    "indication" :
-                    "notification",
-                    event->notify_rx.conn_handle,
-                    event->notify_rx.attr_handle,
-                    OS_MBUF_PKTLEN(event->notify_rx.om));
-
-        /* Attribute data is contained in event->notify_rx.attr_data. */
-        return 0;
+esp_err_t app_ble_write_mbuf(ble_dev_handle_t dev, uint8_t chr_index, struct os_mbuf *om,
+        write_done_func_t cb, void *priv)
+{
+    return app_ble_write_mbuf_opts(dev, chr_index, om, &s_write_opts_default, cb, priv);
+}
 
-    case BLE_GAP_EVENT_MTU:
-        ESP_LOGI(TAG, "MTU update event; conn_handle=%d cid=%d mtu=%d",
-                    event->mtu.conn_handle,
-                    event->mtu.channel_id,
-                    event->mtu.value);
-        return 0;
+esp_err_t app_ble_read(ble_dev_handle_t handle, uint8_t chr_index, read_done_func_t cb, void *priv)
+{
+    struct ble_dev *dev;
 
-    case BLE_GAP_EVENT_REPEAT_PAIRING:
-        /* We already have a bond with the peer, but it is attempting to
-         * establish a new secure link.  This app sacrifices security for
-         * convenience: just throw away the old bond and accept the new link.
-         */
+    if (!cb) {
+        ESP_LOGE(TAG, "Incorrect input");
+        return ESP_ERR_INVALID_ARG;
+    }
+    portENTER_CRITICAL(&s_write_lock);
+    dev = app_ble_dev_get(handle);
+    if (!dev || chr_index >= dev->num_chrs) {
+        portEXIT_CRITICAL(&s_write_lock);
+        ESP_LOGE(TAG, "Incorrect input");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (dev->num_read_waiters == MAX_READ_WAITERS) {
+        portEXIT_CRITICAL(&s_write_lock);
+        return ESP_ERR_NO_MEM;
+    }
+    dev->read_waiters[dev->num_read_waiters].cb = cb;
+    dev->read_waiters[dev->num_read_waiters].priv = priv;
+    dev->read_waiters[dev->num_read_waiters].chr_index = chr_index;
+    dev->num_read_waiters++;
+    dev->stats.reads_submitted++;
+    portEXIT_CRITICAL(&s_write_lock);
 
-        /* Delete the old bond. */
-        rc = ble_gap_conn_find(event->repeat_pairing.conn_handle, &desc);
-        assert(rc == 0);
-        ble_store_util_delete_peer(&desc.peer_id_addr);
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &dev->read_ev);
+    return ESP_OK;
+}
 
-        /* Return BLE_GAP_REPEAT_PAIRING_RETRY to indicate that the host should
-         * continue with the pairing operation.
-         */
-        return BLE_GAP_REPEAT_PAIRING_RETRY;
+esp_err_t app_ble_get_stats(ble_dev_handle_t handle, ble_dev_stats_t *stats)
+{
+    struct ble_dev *dev;
 
-    default:
-        return 0;
+    if (!stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    portENTER_CRITICAL(&s_write_lock);
+    dev = app_ble_dev_get(handle);
+    if (dev) {
+        *stats = dev->stats;
     }
+    portEXIT_CRITICAL(&s_write_lock);
+    return dev ? ESP_OK : ESP_ERR_INVALID_ARG;
 }
 
-static int app_ble_chr_on_write(uint16_t conn_handle, const struct ble_gatt_error *error,
-                 struct ble_gatt_attr *attr, void *arg)
+esp_err_t app_ble_get_sched_stats(ble_sched_stats_t *stats)
 {
-    ESP_LOGI(TAG, "Write complete; status=%d conn_handle=%d attr_handle=%d",
-            error->status, conn_handle, attr->handle);
-    return 0;
+    if (!stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    portENTER_CRITICAL(&s_write_lock);
+    *stats = s_sched_stats;
+    portEXIT_CRITICAL(&s_write_lock);
+    return ESP_OK;
 }
 
-esp_err_t app_ble_update_dev(ble_dev_handle_t dev, uint8_t *data, int len)
+/**
+ * Frees the slot of a removed device once it is disconnected. Whatever is still
+ * waiting for it fails with BLE_HS_ENOTCONN, reported with the old handle.
+ */
+static void app_ble_dev_free(uint32_t dev_index)
 {
-    int rc = ESP_FAIL, i;
-    uint16_t conn_handle, val_handle;
-    uint32_t dev_index = 0xff;
-    for (i = 0; i < MAX_DEV; i++) {
-        if (dev == (void *)&s_ble_dev[i]) {
-            dev_index = i;
-            break;
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    int i;
+
+    ESP_LOGI(TAG, "Removed BLE device %s", dev->adv_name);
+    app_latency_reset_dev(dev_index, NULL, 0);
+    dev->ready = false;
+    app_ble_write_fail_pending(dev_index, 0xff, BLE_HS_ENOTCONN);
+    for (i = 0; i < dev->num_chrs; i++) {
+        app_ble_read_complete(dev_index, i, BLE_HS_ENOTCONN);
+    }
+    if (s_started) {
+        ble_npl_callout_stop(&dev->write_timer);
+        ble_npl_callout_stop(&dev->notify_timer);
+        ble_npl_callout_stop(&dev->backoff_timer);
+        ble_npl_eventq_remove(nimble_port_get_dflt_eventq(), &dev->write_ev);
+        ble_npl_eventq_remove(nimble_port_get_dflt_eventq(), &dev->read_ev);
+    }
+
+    portENTER_CRITICAL(&s_write_lock);
+    for (i = 0; i < dev->num_chrs; i++) {
+        /* Left behind by a write that was in flight */
+        if (dev->write_pending_mask & (1 << i)) {
+            app_ble_sched_dequeue(dev->write_pending[i].prio);
         }
+        app_ble_uuid_release(dev->chrs[i].svc_uuid);
+        app_ble_uuid_release(dev->chrs[i].chr_uuid);
+    }
+    memset(dev, 0, offsetof(struct ble_dev, generation));
+    dev->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    /* Any handle to the old device is stale from now on */
+    dev->generation++;
+    if (!dev->generation) {
+        dev->generation = 1;
+    }
+    s_dev_claimed &= ~(1 << dev_index);
+    portEXIT_CRITICAL(&s_write_lock);
+    if (s_started) {
+        app_ble_adv_index_build();
     }
-    if (dev_index != 0xff) {
-        conn_handle = s_ble_dev[dev_index].conn_handle;
-        val_handle = s_ble_dev[dev_index].chr.val_handle;
-        if (conn_handle == BLE_HS_CONN_HANDLE_NONE) {
-            s_ble_dev[dev_index].reconnect = true;
-            app_ble_scan(1, s_ble_dev[dev_index].adv_name);
-            xSemaphoreTake(s_sem, portMAX_DELAY);
-            conn_handle = s_ble_dev[dev_index].conn_handle;
+}
+
+/**
+ * Takes a removed device down: disconnects it if required, or frees it right away.
+ * Freed from the GAP event handler once the connection is down otherwise.
+ */
+static void app_ble_dev_teardown(uint32_t dev_index)
+{
+    struct ble_dev *dev = &s_ble_dev[dev_index];
+    int rc;
+
+    dev->connect_pending = false;
+    if (dev->conn_handle != BLE_HS_CONN_HANDLE_NONE) {
+        rc = ble_gap_terminate(dev->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        if (rc != 0 && rc != BLE_HS_EALREADY) {
+            ESP_LOGE(TAG, "Failed to disconnect %s; rc=%d", dev->adv_name, rc);
         }
+        return;
+    }
+    if (dev->connecting) {
+        ble_gap_conn_cancel();
+        return;
+    }
+    app_ble_dev_free(dev_index);
+}
 
-        if (conn_handle != BLE_HS_CONN_HANDLE_NONE) {
-            rc = ble_gattc_write_flat(conn_handle, val_handle,
-                    data, len, app_ble_chr_on_write, NULL);
-            if (rc != 0) {
-                ESP_LOGE(TAG, "Failed to write characteristic; rc=%d", rc);
-            }
-        } else {
-            return ESP_FAIL;
+/**
+ * Looks for the devices added after app_ble_start() that are not found yet, and
+ * takes down the removed ones. Always runs in the NimBLE host task.
+ */
+static void app_ble_registry_ev_cb(struct ble_npl_event *ev)
+{
+    struct ble_dev *dev;
+    bool waiting = false;
+    uint32_t i;
+
+    app_ble_adv_index_build();
+    for (i = 0; i < MAX_DEV; i++) {
+        dev = &s_ble_dev[i];
+        if (!dev->adv_name) {
+            continue;
+        }
+        if (dev->removing) {
+            app_ble_dev_teardown(i);
+            continue;
         }
+        if (dev->hotplug && !dev->added) {
+            /* Found the same way as a disconnected device with writes waiting */
+            app_ble_reconnect(i);
+            waiting = true;
+        }
+    }
+    if (waiting) {
+        ble_npl_callout_reset(&s_registry_timer,
+                ble_npl_time_ms_to_ticks32(RESCAN_DURATION_MS + CONNECT_TIMEOUT_MS));
+    }
+}
+
+esp_err_t app_ble_remove_dev(ble_dev_handle_t handle)
+{
+    struct ble_dev *dev;
+
+    portENTER_CRITICAL(&s_write_lock);
+    dev = app_ble_dev_get(handle);
+    if (dev) {
+        dev->removing = true;
+    }
+    portEXIT_CRITICAL(&s_write_lock);
+    if (!dev) {
+        return ESP_ERR_INVALID_ARG;
     }
-    return rc;
+    if (s_started) {
+        ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &s_registry_ev);
+    } else {
+        app_ble_dev_free(DEV_HANDLE_INDEX(handle));
+    }
+    return ESP_OK;
 }
 
 static void app_ble_on_reset(int reason)
@@ -429,12 +2894,26 @@ static void app_ble_on_reset(int reason)
 static void app_ble_on_sync(void)
 {
     int rc;
+    uint32_t i;
     /* Make sure we have proper identity address set (public preferred) */
     rc = ble_hs_util_ensure_addr(0);
     assert(rc == 0);
 
-    /* Begin scanning for a peripheral to connect to. */
-    app_ble_scan(0, NULL);
+    if (s_booting && app_ble_all_added()) {
+        /* No device registered, nothing to wait for */
+        app_ble_boot_done();
+        return;
+    }
+    /* Devices with a known address are connected to directly. The ones that fail
+     * are found by the scan that follows. */
+    for (i = 0; i < MAX_DEV; i++) {
+        if (s_ble_dev[i].adv_name && s_ble_dev[i].addr_valid) {
+            s_ble_dev[i].direct_connect = true;
+            s_ble_dev[i].connect_pending = true;
+        }
+    }
+    /* Scanning for the rest begins once these have been tried */
+    app_ble_connect_next();
 }
 
 void app_ble_host_task(void *param)
@@ -449,15 +2928,44 @@ void app_ble_host_task(void *param)
 void app_ble_start(void)
 {
     int rc;
+    uint32_t i;
 
-    s_sem = xSemaphoreCreateBinary();
-    if (!s_sem) {
+    s_boot_sem = xSemaphoreCreateBinary();
+    if (!s_boot_sem) {
         ESP_LOGE(TAG, "Failed to create semaphore");
         return;
     }
+    s_booting = true;
+    s_boot_start_time = esp_timer_get_time();
+
+    app_ble_adv_index_build();
 
     ESP_ERROR_CHECK(esp_nimble_hci_and_controller_init());
     nimble_port_init();
+
+    for (i = 0; i < MAX_DEV; i++) {
+        if (s_ble_dev[i].adv_name
+                && app_ble_cache_get_addr(s_ble_dev[i].adv_name, s_ble_dev[i].instance,
+                    &s_ble_dev[i].stored_addr) == ESP_OK) {
+            s_ble_dev[i].has_stored_addr = true;
+            s_ble_dev[i].addr = s_ble_dev[i].stored_addr;
+            s_ble_dev[i].addr_valid = true;
+        }
+        ble_npl_event_init(&s_ble_dev[i].write_ev, app_ble_write_ev_cb, (void *)i);
+        ble_npl_callout_init(&s_ble_dev[i].write_timer, nimble_port_get_dflt_eventq(),
+                app_ble_write_ev_cb, (void *)i);
+        ble_npl_callout_init(&s_ble_dev[i].notify_timer, nimble_port_get_dflt_eventq(),
+                app_ble_notify_timer_cb, (void *)i);
+        ble_npl_event_init(&s_ble_dev[i].read_ev, app_ble_read_ev_cb, (void *)i);
+        ble_npl_callout_init(&s_ble_dev[i].backoff_timer, nimble_port_get_dflt_eventq(),
+                app_ble_backoff_timer_cb, (void *)i);
+    }
+    ble_npl_callout_init(&s_conn_pool_timer, nimble_port_get_dflt_eventq(),
+            app_ble_conn_pool_timer_cb, NULL);
+    ble_npl_event_init(&s_registry_ev, app_ble_registry_ev_cb, NULL);
+    ble_npl_callout_init(&s_registry_timer, nimble_port_get_dflt_eventq(),
+            app_ble_registry_ev_cb, NULL);
+    s_started = true;
     /* Configure the host. */
     ble_hs_cfg.reset_cb = app_ble_on_reset;
     ble_hs_cfg.sync_cb = app_ble_on_sync;
@@ -471,5 +2979,5 @@ void app_ble_start(void)
 
     nimble_port_freertos_init(app_ble_host_task);
 
-    xSemaphoreTake(s_sem, portMAX_DELAY);
+    xSemaphoreTake(s_boot_sem, portMAX_DELAY);
 }
@@ -7,33 +7,260 @@
 */
 #pragma once
 #include <sdkconfig.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <esp_err.h>
+#include "host/ble_hs.h"
 
-#define MAX_DEV CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+/* Maximum number of registered devices (up to 32). This is independent of the
+ * number of simultaneous connections: when more devices are registered than
+ * MAX_CONN, idle ones are disconnected and connected again on demand. */
+#define MAX_DEV 16
+/* Maximum number of devices connected at a time */
+#define MAX_CONN CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+/* Retry interval for a connection waiting for a device to become idle, so that
+ * it can be disconnected to make room */
+#define CONN_POOL_RETRY_MS 200
 #define SCAN_DURATION_MS (30 * 1000)
 #define RESCAN_DURATION_MS (5 * 1000)
+/* Advertisers found during a scan window are connected back to back at the end of
+ * the window (or as soon as all registered devices have been seen) */
+#define SCAN_WINDOW_MS (2 * 1000)
+#define CONNECT_TIMEOUT_MS (5 * 1000)
+/* Timeout for connecting to a device by its last known address, without a scan */
+#define DIRECT_CONNECT_TIMEOUT_MS (2 * 1000)
+/* Maximum number of characteristics of a device (up to 8) */
+#define MAX_CHR 4
+/* Maximum number of distinct service and characteristic UUIDs across all the
+ * registered devices (up to 255). Devices of the same model share their entries. */
+#define MAX_UUIDS 32
+/* Maximum length of a single characteristic write (default ATT MTU - 3) */
+#define MAX_WRITE_LEN 20
+/* Write commands sent back to back (for devices configured with write_no_rsp)
+ * before an acknowledged write is required to confirm the state */
+#define WRITE_NO_RSP_CREDITS 4
+/* Write commands are sent only while the host has at least these many free mbufs */
+#define WRITE_NO_RSP_MIN_FREE_MBUFS 4
+/* Maximum length of a notification or indication payload passed to the accessory */
+#define MAX_NOTIFY_LEN 20
+/* Minimum interval between notifications of a characteristic passed to the accessory.
+ * Intermediate values are dropped, the latest one is passed once the interval elapses. */
+#define NOTIFY_MIN_INTERVAL_MS 500
+/* Maximum length of a characteristic value read with app_ble_read() */
+#define MAX_READ_LEN 20
+/* Default time for which a value read (or notified) is served from the cache */
+#define READ_CACHE_TTL_MS (2 * 1000)
+/* Maximum number of app_ble_read() calls waiting for a device at a time */
+#define MAX_READ_WAITERS 4
+/* Maximum number of reads in flight across all the devices */
+#define MAX_READS_IN_FLIGHT 2
+/* Free mbufs left for the host by app_ble_write_buf_get(), for ATT responses and
+ * such. Shares the pool with the rest of the host. */
+#define WRITE_BUF_MIN_FREE_MBUFS 2
+/* Time within which a queued write should be sent, including a reconnection */
+#define WRITE_TIMEOUT_MS (RESCAN_DURATION_MS + CONNECT_TIMEOUT_MS)
+/* A device that drops off is reconnected in the background, without waiting for a
+ * write: after RECONNECT_BACKOFF_MIN_MS, doubling with each failure up to
+ * RECONNECT_BACKOFF_MAX_MS. Each delay is randomised by up to
+ * RECONNECT_BACKOFF_JITTER_PCT percent either way, so that devices dropped together
+ * do not retry in lockstep. While all MAX_CONN connections are in use, the retry is
+ * put off by another delay rather than disconnecting a device for it. */
+#define RECONNECT_BACKOFF_MIN_MS 500
+#define RECONNECT_BACKOFF_MAX_MS (60 * 1000)
+#define RECONNECT_BACKOFF_JITTER_PCT 25
+/* Consecutive failed reconnections after which a device is considered gone. It is
+ * then only tried in the background every RECONNECT_PROBE_MS, besides when written
+ * to or seen advertising. */
+#define RECONNECT_BREAKER_FAILURES 6
+#define RECONNECT_PROBE_MS (5 * 60 * 1000)
 
-typedef esp_err_t (*add_func_t)(void);
-typedef struct ble_dev *ble_dev_handle_t;
+typedef esp_err_t (*add_func_t)(void *priv);
+/* Handle of a registered device. It carries the generation of the device's slot,
+ * so that a handle kept after app_ble_remove_dev() is rejected instead of reaching
+ * the device that takes the slot next. */
+typedef uint32_t ble_dev_handle_t;
+#define BLE_DEV_HANDLE_NONE 0
+/* Connection state of a registered device */
+typedef enum {
+    /* Not connected, and not being reconnected */
+    BLE_DEV_STATE_IDLE = 0,
+    /* Looked for by a scan */
+    BLE_DEV_STATE_SCANNING,
+    /* Connection initiated */
+    BLE_DEV_STATE_CONNECTING,
+    /* Connected, characteristics being discovered (or the cached ones loaded) */
+    BLE_DEV_STATE_DISCOVERING,
+    /* Connected, and writes can be sent */
+    BLE_DEV_STATE_READY,
+    /* Connection lost (or reconnection failed), waiting to be reconnected */
+    BLE_DEV_STATE_BACKOFF,
+    BLE_DEV_STATE_MAX,
+} ble_dev_state_t;
+
+/* Status of a write that was replaced by a newer one before it could be sent */
+#define WRITE_COALESCED (-1)
+
+/* Priority class of a write. A device sends its pending writes by class, then in
+ * the order they were submitted. Devices waiting to be connected are connected by
+ * the class of their most urgent write, taking turns within a class. */
+typedef enum {
+    /* Power and safety, such as turning a device off */
+    WRITE_PRIO_CRITICAL = 0,
+    /* Direct response to a user action, such as a color change. The default. */
+    WRITE_PRIO_INTERACTIVE,
+    /* Reconciliation of the device with the state it should be in */
+    WRITE_PRIO_BACKGROUND,
+    WRITE_PRIO_MAX,
+} write_prio_t;
+
+typedef struct {
+    write_prio_t prio;
+    /* Time within which the write should be sent, after which it is dropped and its
+     * callback gets BLE_HS_ETIMEOUT. 0 for the default WRITE_TIMEOUT_MS. */
+    uint32_t timeout_ms;
+    /* esp_timer_get_time() at which the command behind the write was received, from
+     * which its end to end latency is measured. 0 for the time of submission. */
+    int64_t received;
+} write_opts_t;
+
+/* Called from the BLE host task once a write submitted with app_ble_write() completes.
+ * status is 0 on success, the NimBLE error code (BLE_HS_*, including ATT errors
+ * reported by the peer) otherwise. BLE_HS_ETIMEOUT indicates that the write could
+ * not be sent within WRITE_TIMEOUT_MS. WRITE_COALESCED is reported from within
+ * app_ble_write() for the pending write that the new one replaces. For a device
+ * configured with write_no_rsp, a status of 0 may only mean that the write was
+ * queued in the host, see ble_cfg_t.write_no_rsp. */
+typedef void (*write_done_func_t)(ble_dev_handle_t dev, int status, void *priv);
+
+/* Called from the BLE host task with the value notified (or indicated) by the device
+ * for a characteristic that was subscribed to, at most once every
+ * NOTIFY_MIN_INTERVAL_MS per characteristic. chr_index is the index of the
+ * characteristic in ble_cfg_t.chrs. */
+typedef void (*notify_func_t)(ble_dev_handle_t dev, uint8_t chr_index, const uint8_t *data, int len);
+
+/* Called from the BLE host task once a read requested with app_ble_read() completes.
+ * status is 0 on success, the NimBLE error code otherwise (BLE_HS_ENOTCONN if the
+ * device is not connected). data is only valid for the duration of the call. */
+typedef void (*read_done_func_t)(ble_dev_handle_t dev, uint8_t chr_index, int status,
+        const uint8_t *data, int len, void *priv);
+
+typedef struct {
+    /* Writes submitted with app_ble_write() */
+    uint32_t writes_submitted;
+    /* Writes actually sent over BLE */
+    uint32_t writes_sent;
+    /* Writes replaced by a newer one before they could be sent */
+    uint32_t writes_coalesced;
+    /* Writes that failed or timed out */
+    uint32_t writes_failed;
+    /* Writes sent without response (included in writes_sent) */
+    uint32_t writes_no_rsp;
+    /* Successful and failed reconnections for pending writes */
+    uint32_t reconnects;
+    uint32_t reconnect_failures;
+    /* Time taken by reconnections, from the write that needed it to the device
+     * being ready. reconnect_total_ms / reconnects gives the average. */
+    uint32_t reconnect_last_ms;
+    uint32_t reconnect_max_ms;
+    uint32_t reconnect_total_ms;
+    /* Writes submitted while the device was connected and ready */
+    uint32_t conn_hits;
+    /* Writes submitted while the device was not connected, needing a connection */
+    uint32_t conn_misses;
+    /* Times the device was disconnected to make room for another one */
+    uint32_t conn_evictions;
+    /* Notifications and indications received for subscribed characteristics */
+    uint32_t notifies_received;
+    /* Notified values replaced by a newer one before being passed to the accessory */
+    uint32_t notifies_dropped;
+    /* Reads requested with app_ble_read() */
+    uint32_t reads_submitted;
+    /* Reads served from the cache, without an ATT read */
+    uint32_t read_cache_hits;
+    /* ATT reads sent. Reads requested while one was in flight share its result. */
+    uint32_t reads_sent;
+    /* Reads that failed */
+    uint32_t reads_failed;
+    /* Buffers handed out by app_ble_write_buf_get(), and requests that found the
+     * mbuf pool exhausted (below WRITE_BUF_MIN_FREE_MBUFS free) */
+    uint32_t write_bufs;
+    uint32_t write_buf_failures;
+    /* Lowest number of free mbufs seen by app_ble_write_buf_get() for the device */
+    uint32_t write_buf_min_free;
+    /* Writes dropped because they could not be sent by their deadline (included in
+     * writes_failed) */
+    uint32_t writes_expired;
+    /* Current connection state, and the number of transitions so far */
+    ble_dev_state_t state;
+    uint32_t state_changes;
+    /* Times the device was considered gone, after RECONNECT_BREAKER_FAILURES
+     * failed reconnections in a row */
+    uint32_t breaker_trips;
+} ble_dev_stats_t;
+
+/* Bridge-wide state of the writes, per write_prio_t class */
+typedef struct {
+    /* Writes pending across all the devices, and the highest that has been seen */
+    uint32_t queue_depth[WRITE_PRIO_MAX];
+    uint32_t queue_depth_max[WRITE_PRIO_MAX];
+    /* Writes dropped because they could not be sent by their deadline */
+    uint32_t deadline_misses[WRITE_PRIO_MAX];
+} ble_sched_stats_t;
+
+typedef struct {
+    /* BLE Service UUID of the characteristic. 16, 32 or 128-bit, declared with
+     * BLE_UUID16_DECLARE() and the like. Copied by app_ble_add_dev(). */
+    const ble_uuid_t *svc_uuid;
+    /* BLE Characteristic UUID of the parameter to be controlled */
+    const ble_uuid_t *chr_uuid;
+    /* Subscribe to notifications (or indications, if the characteristic only supports
+     * those) on every connection. The values are passed to ble_cfg_t.notify. */
+    bool subscribe;
+    /* Time for which a value read with app_ble_read() (or notified) is served from
+     * the cache. 0 for the default READ_CACHE_TTL_MS. */
+    uint32_t read_ttl_ms;
+} ble_chr_cfg_t;
 
 typedef struct {
     /* Name seen in BLE advertisement data */
     const char *adv_name;
-    /* 16-bit BLE Characteristic UUID of the parameter to be controlled */
-    uint16_t chr_uuid;
-    /* 16-bit BLE Service UUID of the characteristic */
-    uint16_t svc_uuid;
+    /* Several devices of the same model (same adv_name) are registered with distinct
+     * instance numbers, 0 onwards. Each instance is bound to the address of the first
+     * advertiser it is connected to, which is stored in NVS for that instance, and is
+     * only connected to that advertiser thereafter. A model registered only once
+     * follows its device across address changes. */
+    uint8_t instance;
+    /* Characteristics to be controlled, possibly across several services. They are
+     * addressed by their index in this table in app_ble_write(). */
+    ble_chr_cfg_t chrs[MAX_CHR];
+    /* Number of entries in chrs */
+    uint8_t num_chrs;
     /* Function to add device and its parameters to RainMaker */
     add_func_t add;
+    /* Passed to add(), for accessories registering several devices */
+    void *priv;
+    /* Function to report the notified state of the device to RainMaker. Required if
+     * any of the characteristics is subscribed to. */
+    notify_func_t notify;
+    /* Use write without response (Write Command) for the characteristics that support
+     * it, with an acknowledged write every WRITE_NO_RSP_CREDITS writes. A write sent
+     * as a Write Command is completed with status 0 as soon as the host queues it,
+     * without knowing whether the peer received, let alone applied it. Only for
+     * devices whose state may be reported before it is confirmed. */
+    bool write_no_rsp;
+    /* When more than MAX_CONN devices are registered, devices with a higher priority
+     * are kept connected in preference to ones with a lower priority. Amongst the
+     * devices with the same priority, the least recently used one is disconnected. */
+    uint8_t priority;
 } ble_cfg_t;
 
 /**
  * Start BLE framework
  *
- * This API will start BLE central role and return after scanning for 30 seconds.
- * The interval can be changed by configuring SCAN_DURATION_MS. During this time,
- * it will find all the registered BLE devices of which are discoverable and add them
- * to the RainMaker framework (maximum upto MAX_DEV)
+ * This API will start BLE central role and return once all the registered BLE devices
+ * have been found and added to the RainMaker framework (maximum upto MAX_DEV), or after
+ * scanning for 30 seconds, whichever is earlier. The upper bound can be changed by
+ * configuring SCAN_DURATION_MS.
  *
  * @note This API should be called after esp_rmaker_init() but before esp_rmaker_start()
  */
@@ -45,26 +272,174 @@ void app_ble_start(void);
  * This API will add a RainMaker device and its parameters as per the functionality
  * exposed by the BLE device.
  *
+ * Devices can also be added after app_ble_start(). They are looked for in the
+ * background, and added to RainMaker once found.
+ *
  * @param[in] cfg BLE configuration of type ble_cfg_t
  *
  * @return BLE device handle if the device is added successfully.
- * @return NULL in case of failures.
+ * @return BLE_DEV_HANDLE_NONE in case of failures.
  */
 ble_dev_handle_t app_ble_add_dev(ble_cfg_t *cfg);
 
+/**
+ * Remove a BLE device
+ *
+ * The handle is invalid from the time this is called. The device is disconnected in
+ * the background, and its pending writes and reads fail with BLE_HS_ENOTCONN. Its
+ * slot can be reused by app_ble_add_dev() once the connection is down. The RainMaker
+ * device added for it is left as is.
+ *
+ * @param[in] dev BLE device handle returned from app_ble_add_dev()
+ *
+ * @return ESP_OK if successful.
+ * @return ESP_ERR_INVALID_ARG if the handle is not valid (anymore).
+ */
+esp_err_t app_ble_remove_dev(ble_dev_handle_t dev);
+
 /**
  * Update the BLE device parameter
  *
- * This API will update (write) the parameter (characteristic) value over BLE
+ * This API will queue a write of the parameter (characteristic) value over BLE and
+ * return immediately. If the device is not connected, it is rescanned for in the
+ * background. Writes for different devices do not block each other.
+ *
+ * A device has at most one write in flight and one pending per characteristic. If a
+ * write is already pending for the characteristic, it is replaced by this one (its
+ * callback gets WRITE_COALESCED), so that a burst of updates only sends the latest
+ * value once the previous write is done. Pending writes to different characteristics
+ * are sent by priority class (see app_ble_write_opts()), then in the order they
+ * were submitted.
  *
  * @param[in] dev BLE device handle returned from app_ble_add_dev()
- * @param[in] data Data to be written
+ * @param[in] chr_index Index of the characteristic in ble_cfg_t.chrs
+ * @param[in] data Data to be written (copied, maximum MAX_WRITE_LEN bytes)
  * @param[in] len Length of the data
+ * @param[in] cb Function to be called once the write completes or fails. Can be NULL.
+ * @param[in] priv Private data passed to cb
  *
- * @return ESP_OK if successful.
+ * @return ESP_OK if the write was queued.
  * @return error in case of failures.
  *
  * @note The call to this API should be preceded by mapping the data received from
- * RainMaker cloud to the format accepted by the BLE device.
+ * RainMaker cloud to the format accepted by the BLE device. The value should be
+ * reported back to RainMaker from cb, once the write has actually succeeded.
+ */
+esp_err_t app_ble_write(ble_dev_handle_t dev, uint8_t chr_index, const uint8_t *data, int len,
+        write_done_func_t cb, void *priv);
+
+/**
+ * Update the BLE device parameter, with a priority class and deadline
+ *
+ * Same as app_ble_write(), which uses WRITE_PRIO_INTERACTIVE and WRITE_TIMEOUT_MS.
+ * If a write is already pending for the characteristic, this one replaces it with
+ * the more urgent of the two classes, as it carries the latest state of both.
+ *
+ * @param[in] dev BLE device handle returned from app_ble_add_dev()
+ * @param[in] chr_index Index of the characteristic in ble_cfg_t.chrs
+ * @param[in] data Data to be written (copied, maximum MAX_WRITE_LEN bytes)
+ * @param[in] len Length of the data
+ * @param[in] opts Priority class and deadline of the write
+ * @param[in] cb Function to be called once the write completes or fails. Can be NULL.
+ * @param[in] priv Private data passed to cb
+ *
+ * @return ESP_OK if the write was queued.
+ * @return error in case of failures.
+ */
+esp_err_t app_ble_write_opts(ble_dev_handle_t dev, uint8_t chr_index, const uint8_t *data, int len,
+        const write_opts_t *opts, write_done_func_t cb, void *priv);
+
+/**
+ * Get a buffer for a write to the BLE device
+ *
+ * The buffer is an mbuf from the host's pool, with room reserved for the ATT header.
+ * The value can be encoded into it in place (for example with os_mbuf_extend()) and
+ * queued with app_ble_write_mbuf(), sparing the copies of app_ble_write(). Meant for
+ * accessories writing at a high rate.
+ *
+ * @param[in] dev BLE device handle returned from app_ble_add_dev()
+ *
+ * @return Buffer, to be passed to app_ble_write_mbuf() or freed with os_mbuf_free_chain().
+ * @return NULL if the pool is exhausted. app_ble_write() can be used instead.
+ */
+struct os_mbuf *app_ble_write_buf_get(ble_dev_handle_t dev);
+
+/**
+ * Update the BLE device parameter from a buffer
+ *
+ * Same as app_ble_write(), except that the value is taken from a buffer returned by
+ * app_ble_write_buf_get(), which is sent as is.
+ *
+ * @param[in] dev BLE device handle returned from app_ble_add_dev()
+ * @param[in] chr_index Index of the characteristic in ble_cfg_t.chrs
+ * @param[in] om Buffer holding the value (maximum MAX_WRITE_LEN bytes). It is freed
+ *               by this API in all cases, including failures.
+ * @param[in] cb Function to be called once the write completes or fails. Can be NULL.
+ * @param[in] priv Private data passed to cb
+ *
+ * @return ESP_OK if the write was queued.
+ * @return error in case of failures.
+ */
+esp_err_t app_ble_write_mbuf(ble_dev_handle_t dev, uint8_t chr_index, struct os_mbuf *om,
+        write_done_func_t cb, void *priv);
+
+/**
+ * Update the BLE device parameter from a buffer, with a priority class and deadline
+ *
+ * Same as app_ble_write_mbuf(), with the options of app_ble_write_opts().
+ *
+ * @param[in] dev BLE device handle returned from app_ble_add_dev()
+ * @param[in] chr_index Index of the characteristic in ble_cfg_t.chrs
+ * @param[in] om Buffer holding the value, freed by this API in all cases
+ * @param[in] opts Priority class and deadline of the write
+ * @param[in] cb Function to be called once the write completes or fails. Can be NULL.
+ * @param[in] priv Private data passed to cb
+ *
+ * @return ESP_OK if the write was queued.
+ * @return error in case of failures.
+ */
+esp_err_t app_ble_write_mbuf_opts(ble_dev_handle_t dev, uint8_t chr_index, struct os_mbuf *om,
+        const write_opts_t *opts, write_done_func_t cb, void *priv);
+
+/**
+ * Read the BLE device parameter
+ *
+ * This API will queue a read of the parameter (characteristic) value and return
+ * immediately. cb is called from the BLE host task with the value.
+ *
+ * The value is served from a cache if it was read (or notified) within the TTL of
+ * the characteristic, and a successful write to the characteristic invalidates it.
+ * Reads requested while an ATT read of the characteristic is in flight share its
+ * result. Unlike writes, reads do not reconnect to the device.
+ *
+ * @param[in] dev BLE device handle returned from app_ble_add_dev()
+ * @param[in] chr_index Index of the characteristic in ble_cfg_t.chrs
+ * @param[in] cb Function to be called with the value
+ * @param[in] priv Private data passed to cb
+ *
+ * @return ESP_OK if the read was queued.
+ * @return ESP_ERR_NO_MEM if MAX_READ_WAITERS reads are already waiting for the device.
+ * @return error in case of other failures.
+ */
+esp_err_t app_ble_read(ble_dev_handle_t dev, uint8_t chr_index, read_done_func_t cb, void *priv);
+
+/**
+ * Get the statistics of a BLE device
+ *
+ * @param[in] dev BLE device handle returned from app_ble_add_dev()
+ * @param[out] stats Statistics of the device
+ *
+ * @return ESP_OK if successful.
+ * @return error in case of failures.
+ */
+esp_err_t app_ble_get_stats(ble_dev_handle_t dev, ble_dev_stats_t *stats);
+
+/**
+ * Get the bridge-wide statistics of the writes, per priority class
+ *
+ * @param[out] stats Statistics of the writes
+ *
+ * @return ESP_OK if successful.
+ * @return error in case of failures.
  */
-esp_err_t app_ble_update_dev(ble_dev_handle_t dev, uint8_t *data, int len);
+esp_err_t app_ble_get_sched_stats(ble_sched_stats_t *stats);
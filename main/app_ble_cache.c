@@ -0,0 +1,156 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <esp_log.h>
+#include <nvs.h>
+#include "app_ble_cache.h"
+
+#define CACHE_NVS_NAMESPACE "ble_cache"
+/* Bump up whenever the layout of the cached data changes */
+#define HANDLE_CACHE_VERSION 4
+
+static const char *TAG = "app_ble_cache";
+
+struct handle_cache_blob {
+    uint8_t version;
+    ble_handle_cache_t cache;
+};
+
+/* NVS keys are limited to 15 characters, so the address is used as is in hex,
+ * prefixed by the type of data */
+static void app_ble_cache_key(char prefix, const ble_addr_t *addr, char *key, size_t len)
+{
+    snprintf(key, len, "%c%02x%02x%02x%02x%02x%02x", prefix,
+            addr->val[5], addr->val[4], addr->val[3], addr->val[2], addr->val[1], addr->val[0]);
+}
+
+/* Registered names can be longer than an NVS key, so a hash of the name is used.
+ * Instances other than the first are suffixed, which keeps the keys stored before
+ * instances were introduced valid for the first one. */
+static void app_ble_cache_name_key(char prefix, const char *name, uint8_t instance,
+        char *key, size_t len)
+{
+    uint32_t hash = 5381;
+
+    while (*name) {
+        hash = (hash * 33) ^ (uint8_t)*name++;
+    }
+    if (instance) {
+        snprintf(key, len, "%c%08" PRIx32 "-%u", prefix, hash, instance);
+    } else {
+        snprintf(key, len, "%c%08" PRIx32, prefix, hash);
+    }
+}
+
+static esp_err_t app_ble_cache_get(const char *key, void *data, size_t len)
+{
+    size_t out_len = len;
+    nvs_handle_t handle;
+    esp_err_t err;
+
+    err = nvs_open(CACHE_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_get_blob(handle, key, data, &out_len);
+    nvs_close(handle);
+    if (err == ESP_OK && out_len != len) {
+        ESP_LOGW(TAG, "Ignoring stale cache entry %s", key);
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    return err;
+}
+
+static esp_err_t app_ble_cache_set(const char *key, const void *data, size_t len)
+{
+    nvs_handle_t handle;
+    esp_err_t err;
+
+    err = nvs_open(CACHE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS namespace; err=%d", err);
+        return err;
+    }
+    err = nvs_set_blob(handle, key, data, len);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store cache entry %s; err=%d", key, err);
+    }
+    return err;
+}
+
+esp_err_t app_ble_cache_get_handles(const ble_addr_t *addr, ble_handle_cache_t *cache)
+{
+    struct handle_cache_blob blob;
+    char key[16];
+    esp_err_t err;
+
+    app_ble_cache_key('h', addr, key, sizeof(key));
+    err = app_ble_cache_get(key, &blob, sizeof(blob));
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (blob.version != HANDLE_CACHE_VERSION) {
+        ESP_LOGW(TAG, "Ignoring stale cache entry %s", key);
+        return ESP_ERR_INVALID_VERSION;
+    }
+    *cache = blob.cache;
+    return ESP_OK;
+}
+
+esp_err_t app_ble_cache_set_handles(const ble_addr_t *addr, const ble_handle_cache_t *cache)
+{
+    struct handle_cache_blob blob = {
+        .version = HANDLE_CACHE_VERSION,
+        .cache = *cache,
+    };
+    char key[16];
+
+    app_ble_cache_key('h', addr, key, sizeof(key));
+    return app_ble_cache_set(key, &blob, sizeof(blob));
+}
+
+esp_err_t app_ble_cache_erase_handles(const ble_addr_t *addr)
+{
+    nvs_handle_t handle;
+    char key[16];
+    esp_err_t err;
+
+    err = nvs_open(CACHE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    app_ble_cache_key('h', addr, key, sizeof(key));
+    err = nvs_erase_key(handle, key);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t app_ble_cache_get_addr(const char *name, uint8_t instance, ble_addr_t *addr)
+{
+    char key[16];
+
+    app_ble_cache_name_key('a', name, instance, key, sizeof(key));
+    return app_ble_cache_get(key, addr, sizeof(*addr));
+}
+
+esp_err_t app_ble_cache_set_addr(const char *name, uint8_t instance, const ble_addr_t *addr)
+{
+    char key[16];
+
+    app_ble_cache_name_key('a', name, instance, key, sizeof(key));
+    return app_ble_cache_set(key, addr, sizeof(*addr));
+}
@@ -0,0 +1,98 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include "host/ble_hs.h"
+#include "app_ble.h"
+
+/* Size of the GATT Database Hash characteristic value */
+#define GATT_DB_HASH_LEN 16
+
+/* Handle of a characteristic, as found by discovery. A val_handle of 0 means that
+ * the characteristic was not found. */
+typedef struct {
+    /* UUIDs the handle was discovered for */
+    ble_uuid_any_t svc_uuid;
+    ble_uuid_any_t chr_uuid;
+    uint16_t val_handle;
+    uint8_t properties;
+    /* Last handle of the characteristic definition and its Client Characteristic
+     * Configuration Descriptor (0 if not discovered) */
+    uint16_t end_handle;
+    uint16_t cccd_handle;
+} ble_chr_handle_cache_t;
+
+/* GATT handles of a BLE device, as found by service and characteristic discovery */
+typedef struct {
+    /* Characteristics in the order of registration. An entry is only valid for the
+     * same registration. */
+    uint8_t num_chrs;
+    ble_chr_handle_cache_t chrs[MAX_CHR];
+    /* Database Hash of the peer, if it exposes one. A change in the hash means that
+     * the handles may have changed. */
+    bool has_db_hash;
+    uint8_t db_hash[GATT_DB_HASH_LEN];
+} ble_handle_cache_t;
+
+/**
+ * Get the cached GATT handles of a BLE device
+ *
+ * @param[in] addr Address of the BLE device
+ * @param[out] cache Cached handles
+ *
+ * @return ESP_OK if the handles were found.
+ * @return error in case of failures or if nothing is cached for the device.
+ */
+esp_err_t app_ble_cache_get_handles(const ble_addr_t *addr, ble_handle_cache_t *cache);
+
+/**
+ * Cache the GATT handles of a BLE device in NVS
+ *
+ * @param[in] addr Address of the BLE device
+ * @param[in] cache Handles to be cached
+ *
+ * @return ESP_OK if successful.
+ * @return error in case of failures.
+ */
+esp_err_t app_ble_cache_set_handles(const ble_addr_t *addr, const ble_handle_cache_t *cache);
+
+/**
+ * Remove the cached GATT handles of a BLE device
+ *
+ * @param[in] addr Address of the BLE device
+ *
+ * @return ESP_OK if successful.
+ * @return error in case of failures.
+ */
+esp_err_t app_ble_cache_erase_handles(const ble_addr_t *addr);
+
+/**
+ * Get the last known address of a registered BLE device
+ *
+ * @param[in] name Advertised name the device is registered with
+ * @param[in] instance Instance of the device amongst the ones registered with the name
+ * @param[out] addr Address of the device
+ *
+ * @return ESP_OK if an address was found.
+ * @return error in case of failures or if no address is known.
+ */
+esp_err_t app_ble_cache_get_addr(const char *name, uint8_t instance, ble_addr_t *addr);
+
+/**
+ * Store the address of a registered BLE device in NVS
+ *
+ * @param[in] name Advertised name the device is registered with
+ * @param[in] instance Instance of the device amongst the ones registered with the name
+ * @param[in] addr Address of the device
+ *
+ * @return ESP_OK if successful.
+ * @return error in case of failures.
+ */
+esp_err_t app_ble_cache_set_addr(const char *name, uint8_t instance, const ble_addr_t *addr);
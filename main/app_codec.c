@@ -0,0 +1,41 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include "app_codec.h"
+
+static bool app_codec_field_valid(const codec_field_t *field, uint8_t len)
+{
+    return CODEC_VALID_WIDTH(field->width) && field->offset + field->width <= len;
+}
+
+bool app_codec_frame_valid(const codec_frame_t *frame)
+{
+    const codec_checksum_t *checksum;
+    int i;
+
+    if (!frame || !frame->tmpl || !frame->len || frame->num_fields > CODEC_MAX_FIELDS) {
+        return false;
+    }
+    for (i = 0; i < frame->num_fields; i++) {
+        if (!app_codec_field_valid(&frame->fields[i], frame->len)) {
+            return false;
+        }
+    }
+    if (frame->seq.width && !app_codec_field_valid(&frame->seq, frame->len)) {
+        return false;
+    }
+    checksum = &frame->checksum;
+    if (checksum->type != CODEC_CHECKSUM_NONE) {
+        if (checksum->start >= checksum->end || checksum->end > frame->len
+                || checksum->offset >= frame->len
+                || (checksum->offset >= checksum->start && checksum->offset < checksum->end)) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,133 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+/* Maximum number of value fields in a frame */
+#define CODEC_MAX_FIELDS 4
+
+/* Evaluates to val, failing the build if cond (a constant expression) is false */
+#define CODEC_CHECKED(val, cond) \
+    ((val) + 0 * sizeof(struct { _Static_assert(cond, "Invalid frame layout: " #cond); int dummy; }))
+
+#define CODEC_VALID_WIDTH(w) ((w) == 1 || (w) == 2 || (w) == 4)
+
+/* Field of w bytes (1, 2 or 4) at off in a frame of len bytes */
+#define CODEC_FIELD(len, off, w) { \
+    .offset = CODEC_CHECKED(off, (off) + (w) <= (len)), \
+    .width = CODEC_CHECKED(w, CODEC_VALID_WIDTH(w)), \
+    .big_endian = false }
+#define CODEC_FIELD_BE(len, off, w) { \
+    .offset = CODEC_CHECKED(off, (off) + (w) <= (len)), \
+    .width = CODEC_CHECKED(w, CODEC_VALID_WIDTH(w)), \
+    .big_endian = true }
+
+/* Checksum of the bytes from first to last (exclusive), stored at off */
+#define CODEC_CHECKSUM(len, kind, first, last, off) { \
+    .type = (kind), \
+    .start = CODEC_CHECKED(first, (first) < (last)), \
+    .end = CODEC_CHECKED(last, (last) <= (len)), \
+    .offset = CODEC_CHECKED(off, (off) < (len) && ((off) < (first) || (off) >= (last))) }
+
+typedef enum {
+    CODEC_CHECKSUM_NONE = 0,
+    /* 8-bit sum of the bytes */
+    CODEC_CHECKSUM_SUM8,
+    /* XOR of the bytes */
+    CODEC_CHECKSUM_XOR8,
+} codec_checksum_type_t;
+
+typedef struct {
+    uint8_t offset;
+    /* Width in bytes, 0 for an unused field */
+    uint8_t width;
+    bool big_endian;
+} codec_field_t;
+
+typedef struct {
+    codec_checksum_type_t type;
+    uint8_t start;
+    uint8_t end;
+    uint8_t offset;
+} codec_checksum_t;
+
+/* Layout of a frame written to an accessory: fixed bytes, value fields, an optional
+ * sequence counter and an optional checksum. Build the fields with the macros above
+ * so that a layout that does not fit the frame fails to compile. */
+typedef struct {
+    /* Fixed bytes of the frame, which the fields are encoded over */
+    const uint8_t *tmpl;
+    uint8_t len;
+    codec_field_t fields[CODEC_MAX_FIELDS];
+    uint8_t num_fields;
+    /* Counter incremented for every frame encoded. Width 0 for none. */
+    codec_field_t seq;
+    codec_checksum_t checksum;
+} codec_frame_t;
+
+/**
+ * Check the layout of a frame
+ *
+ * Layouts built with the macros above are checked at compile time. This is for
+ * the ones that are not, and is meant to be called once, at registration.
+ *
+ * @param[in] frame Layout to be checked
+ *
+ * @return true if every field and the checksum fit in the frame.
+ * @return false otherwise.
+ */
+bool app_codec_frame_valid(const codec_frame_t *frame);
+
+static inline void app_codec_put(const codec_field_t *field, uint32_t value, uint8_t *buf)
+{
+    for (int i = 0; i < field->width; i++) {
+        int shift = field->big_endian ? (field->width - 1 - i) * 8 : i * 8;
+        buf[field->offset + i] = value >> shift;
+    }
+}
+
+/**
+ * Encode a frame
+ *
+ * This loops over the fields and their bytes, even for a layout that is a constant,
+ * and takes several times as long as a frame built by hand (see
+ * host_test/bench_codec.c). Next to the BLE write the frame is for, that is
+ * negligible.
+ *
+ * @param[in] frame Layout of the frame
+ * @param[in] values Value of each field of the frame, in the order of frame->fields
+ * @param[in,out] seq Sequence counter of the accessory, incremented if the frame has
+ *                    one. Can be NULL otherwise.
+ * @param[out] buf Buffer of at least frame->len bytes
+ *
+ * @return Length of the encoded frame.
+ */
+static inline size_t app_codec_encode(const codec_frame_t *frame, const uint32_t *values,
+        uint32_t *seq, uint8_t *buf)
+{
+    int i;
+
+    memcpy(buf, frame->tmpl, frame->len);
+    for (i = 0; i < frame->num_fields; i++) {
+        app_codec_put(&frame->fields[i], values[i], buf);
+    }
+    if (frame->seq.width && seq) {
+        app_codec_put(&frame->seq, (*seq)++, buf);
+    }
+    if (frame->checksum.type != CODEC_CHECKSUM_NONE) {
+        uint8_t sum = 0;
+        for (i = frame->checksum.start; i < frame->checksum.end; i++) {
+            sum = frame->checksum.type == CODEC_CHECKSUM_SUM8 ? sum + buf[i] : sum ^ buf[i];
+        }
+        buf[frame->checksum.offset] = sum;
+    }
+    return frame->len;
+}
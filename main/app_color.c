@@ -0,0 +1,157 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <math.h>
+#include "app_color.h"
+
+/* Spacing of the color temperature table */
+#define CCT_STEP_K 500
+
+/* RGB of a black body at COLOR_CCT_MIN_K, COLOR_CCT_MIN_K + CCT_STEP_K, ...,
+ * COLOR_CCT_MAX_K (Tanner Helland's approximation) */
+static const color_rgb_t s_cct_table[] = {
+    {255, 108,   0}, /*  1500 K */
+    {255, 137,  14}, /*  2000 K */
+    {255, 159,  70}, /*  2500 K */
+    {255, 177, 110}, /*  3000 K */
+    {255, 193, 141}, /*  3500 K */
+    {255, 206, 166}, /*  4000 K */
+    {255, 218, 187}, /*  4500 K */
+    {255, 228, 206}, /*  5000 K */
+    {255, 237, 222}, /*  5500 K */
+    {255, 246, 237}, /*  6000 K */
+    {255, 254, 250}, /*  6500 K */
+    {243, 242, 255}, /*  7000 K */
+    {230, 235, 255}, /*  7500 K */
+    {221, 230, 255}, /*  8000 K */
+    {215, 226, 255}, /*  8500 K */
+    {210, 223, 255}, /*  9000 K */
+    {205, 220, 255}, /*  9500 K */
+    {202, 218, 255}, /* 10000 K */
+};
+_Static_assert(sizeof(s_cct_table) / sizeof(s_cct_table[0]) ==
+        (COLOR_CCT_MAX_K - COLOR_CCT_MIN_K) / CCT_STEP_K + 1, "CCT table size mismatch");
+
+void app_color_hsv2rgb(const color_hsv_t *hsv, color_rgb_t *rgb)
+{
+    uint32_t h = hsv->h % 360;
+    /* v * 255 / 100 is what v * 2.55f truncates to, for every v in range */
+    uint32_t rgb_max = hsv->v * 255 / 100;
+    uint32_t rgb_min = rgb_max * (100 - hsv->s) / 100;
+
+    uint32_t i = h / 60;
+    uint32_t diff = h % 60;
+
+    /* RGB adjustment amount by hue */
+    uint32_t rgb_adj = (rgb_max - rgb_min) * diff / 60;
+
+    switch (i) {
+    case 0:
+        rgb->r = rgb_max;
+        rgb->g = rgb_min + rgb_adj;
+        rgb->b = rgb_min;
+        break;
+    case 1:
+        rgb->r = rgb_max - rgb_adj;
+        rgb->g = rgb_max;
+        rgb->b = rgb_min;
+        break;
+    case 2:
+        rgb->r = rgb_min;
+        rgb->g = rgb_max;
+        rgb->b = rgb_min + rgb_adj;
+        break;
+    case 3:
+        rgb->r = rgb_min;
+        rgb->g = rgb_max - rgb_adj;
+        rgb->b = rgb_max;
+        break;
+    case 4:
+        rgb->r = rgb_min + rgb_adj;
+        rgb->g = rgb_min;
+        rgb->b = rgb_max;
+        break;
+    default:
+        rgb->r = rgb_max;
+        rgb->g = rgb_min;
+        rgb->b = rgb_max - rgb_adj;
+        break;
+    }
+}
+
+static uint8_t app_color_lerp(uint8_t a, uint8_t b, uint32_t frac, uint32_t range)
+{
+    return (a * (range - frac) + b * frac) / range;
+}
+
+void app_color_cct2rgb(uint16_t kelvin, uint8_t v, color_rgb_t *rgb)
+{
+    uint32_t i, frac;
+
+    if (kelvin < COLOR_CCT_MIN_K) {
+        kelvin = COLOR_CCT_MIN_K;
+    } else if (kelvin > COLOR_CCT_MAX_K) {
+        kelvin = COLOR_CCT_MAX_K;
+    }
+    i = (kelvin - COLOR_CCT_MIN_K) / CCT_STEP_K;
+    frac = (kelvin - COLOR_CCT_MIN_K) % CCT_STEP_K;
+    if (frac == 0) {
+        *rgb = s_cct_table[i];
+    } else {
+        rgb->r = app_color_lerp(s_cct_table[i].r, s_cct_table[i + 1].r, frac, CCT_STEP_K);
+        rgb->g = app_color_lerp(s_cct_table[i].g, s_cct_table[i + 1].g, frac, CCT_STEP_K);
+        rgb->b = app_color_lerp(s_cct_table[i].b, s_cct_table[i + 1].b, frac, CCT_STEP_K);
+    }
+    rgb->r = rgb->r * v / 100;
+    rgb->g = rgb->g * v / 100;
+    rgb->b = rgb->b * v / 100;
+}
+
+esp_err_t app_color_profile_init(color_profile_t *profile, uint16_t gamma_x100,
+        uint8_t wb_r, uint8_t wb_g, uint8_t wb_b)
+{
+    const uint8_t wb[3] = {wb_r, wb_g, wb_b};
+    float gamma = gamma_x100 / 100.0f;
+    uint32_t corrected;
+    int c, x;
+
+    if (!profile || !gamma_x100) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (x = 0; x < 256; x++) {
+        if (gamma_x100 == COLOR_GAMMA_LINEAR) {
+            corrected = x;
+        } else {
+            corrected = (uint32_t)(powf(x / 255.0f, gamma) * 255.0f + 0.5f);
+        }
+        for (c = 0; c < 3; c++) {
+            profile->lut[c][x] = corrected * wb[c] / COLOR_WB_UNITY;
+        }
+    }
+    return ESP_OK;
+}
+
+void app_color_apply(const color_profile_t *profile, color_rgb_t *rgb)
+{
+    rgb->r = profile->lut[0][rgb->r];
+    rgb->g = profile->lut[1][rgb->g];
+    rgb->b = profile->lut[2][rgb->b];
+}
+
+void app_color_hsv2rgb_batch(const color_hsv_t *hsv, color_rgb_t *rgb, size_t count,
+        const color_profile_t *profile)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        app_color_hsv2rgb(&hsv[i], &rgb[i]);
+        if (profile) {
+            app_color_apply(profile, &rgb[i]);
+        }
+    }
+}
@@ -0,0 +1,106 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <esp_err.h>
+
+/* Gamma of a profile that does not alter the values, in hundredths */
+#define COLOR_GAMMA_LINEAR 100
+/* White balance gain of a channel that does not alter the values */
+#define COLOR_WB_UNITY 255
+/* Range supported by app_color_cct2rgb() */
+#define COLOR_CCT_MIN_K 1500
+#define COLOR_CCT_MAX_K 10000
+
+typedef struct {
+    /* Hue in degrees (taken modulo 360) */
+    uint16_t h;
+    /* Saturation and value (brightness) in percent, 0 to 100 */
+    uint8_t s;
+    uint8_t v;
+} color_hsv_t;
+
+typedef struct {
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+} color_rgb_t;
+
+/* Output correction of an accessory: gamma and white balance of each channel,
+ * folded into a lookup table so that applying it takes no arithmetic */
+typedef struct {
+    uint8_t lut[3][256];
+} color_profile_t;
+
+/**
+ * Clamp a saturation or value (brightness) to the percentage color_hsv_t takes.
+ * RainMaker does not enforce the bounds of the params, and some accessories use
+ * defaults beyond 100.
+ */
+static inline uint8_t app_color_percent(uint32_t value)
+{
+    return value > 100 ? 100 : value;
+}
+
+/**
+ * Convert HSV to RGB
+ *
+ * Integer only, producing the same values as the conversion the accessories
+ * originally used.
+ *
+ * @param[in] hsv Color to be converted
+ * @param[out] rgb Converted color, 0 to 255 per channel
+ */
+void app_color_hsv2rgb(const color_hsv_t *hsv, color_rgb_t *rgb);
+
+/**
+ * Convert a color temperature to RGB
+ *
+ * @param[in] kelvin Color temperature, clamped to COLOR_CCT_MIN_K - COLOR_CCT_MAX_K
+ * @param[in] v Value (brightness) in percent, 0 to 100
+ * @param[out] rgb Converted color, 0 to 255 per channel
+ */
+void app_color_cct2rgb(uint16_t kelvin, uint8_t v, color_rgb_t *rgb);
+
+/**
+ * Initialise the output correction profile of an accessory
+ *
+ * This uses floating point math and is meant to be called once, at registration.
+ *
+ * @param[out] profile Profile to be initialised
+ * @param[in] gamma_x100 Gamma in hundredths (COLOR_GAMMA_LINEAR for none)
+ * @param[in] wb_r Gain of the red channel, out of COLOR_WB_UNITY
+ * @param[in] wb_g Gain of the green channel, out of COLOR_WB_UNITY
+ * @param[in] wb_b Gain of the blue channel, out of COLOR_WB_UNITY
+ *
+ * @return ESP_OK if successful.
+ * @return error in case of failures.
+ */
+esp_err_t app_color_profile_init(color_profile_t *profile, uint16_t gamma_x100,
+        uint8_t wb_r, uint8_t wb_g, uint8_t wb_b);
+
+/**
+ * Apply the output correction profile of an accessory to a color
+ *
+ * @param[in] profile Profile initialised with app_color_profile_init()
+ * @param[in,out] rgb Color to be corrected
+ */
+void app_color_apply(const color_profile_t *profile, color_rgb_t *rgb);
+
+/**
+ * Convert a number of HSV colors to RGB and apply an output correction profile,
+ * for example for all the lights of a scene of the same model
+ *
+ * @param[in] hsv Colors to be converted
+ * @param[out] rgb Converted colors
+ * @param[in] count Number of colors
+ * @param[in] profile Profile to be applied, or NULL for none
+ */
+void app_color_hsv2rgb_batch(const color_hsv_t *hsv, color_rgb_t *rgb, size_t count,
+        const color_profile_t *profile);
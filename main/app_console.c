@@ -0,0 +1,131 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+#include <esp_console.h>
+#include <esp_vfs_dev.h>
+#include <driver/uart.h>
+#include <linenoise/linenoise.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <sdkconfig.h>
+
+#include "app_console.h"
+#include "app_trace.h"
+#include "app_latency.h"
+
+static const char *TAG = "app_console";
+
+static int app_console_trace(int argc, char **argv)
+{
+    app_trace_stats_t stats;
+
+    if (argc >= 2 && strcmp(argv[1], "dump") == 0) {
+        app_trace_dump(argc >= 3 ? strtoul(argv[2], NULL, 0) : APP_TRACE_RING_LEN);
+        return 0;
+    }
+    if (argc == 3 && strcmp(argv[1], "live") == 0) {
+        app_trace_set_live(strcmp(argv[2], "on") == 0);
+        return 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "stats") == 0) {
+        app_trace_get_stats(&stats);
+        printf("recorded=%u lost=%u live=%s\n", stats.recorded, stats.lost,
+                stats.live ? "on" : "off");
+        return 0;
+    }
+    printf("Usage: trace dump [count] | trace live on|off | trace stats\n");
+    return 1;
+}
+
+static int app_console_latency(int argc, char **argv)
+{
+    if (argc == 1) {
+        app_latency_dump();
+        return 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        app_latency_reset();
+        return 0;
+    }
+    printf("Usage: latency [reset]\n");
+    return 1;
+}
+
+static void app_console_task(void *param)
+{
+    const char *prompt = "bridge> ";
+    char *line;
+    int ret;
+
+    if (linenoiseProbe() != 0) {
+        /* The terminal does not support escape sequences */
+        linenoiseSetDumbMode(1);
+    }
+    while (1) {
+        line = linenoise(prompt);
+        if (!line) {
+            continue;
+        }
+        if (strlen(line) > 0) {
+            linenoiseHistoryAdd(line);
+            if (esp_console_run(line, &ret) == ESP_ERR_NOT_FOUND) {
+                printf("Unknown command: %s\n", line);
+            }
+        }
+        linenoiseFree(line);
+    }
+}
+
+esp_err_t app_console_start(void)
+{
+    esp_console_config_t console_config = ESP_CONSOLE_CONFIG_DEFAULT();
+    const esp_console_cmd_t trace_cmd = {
+        .command = "trace",
+        .help = "Inspect the BLE event trace: dump [count], live on|off, stats",
+        .func = app_console_trace,
+    };
+    const esp_console_cmd_t latency_cmd = {
+        .command = "latency",
+        .help = "Print the latency percentiles and throughput of the commands per device, or reset them",
+        .func = app_console_latency,
+    };
+    esp_err_t err;
+
+    /* Blocking reads from the UART driver, with the line endings of a terminal */
+    setvbuf(stdin, NULL, _IONBF, 0);
+    esp_vfs_dev_uart_set_rx_line_endings(ESP_LINE_ENDINGS_CR);
+    esp_vfs_dev_uart_set_tx_line_endings(ESP_LINE_ENDINGS_CRLF);
+    err = uart_driver_install(CONFIG_ESP_CONSOLE_UART_NUM, 256, 0, 0, NULL, 0);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to install the UART driver");
+        return err;
+    }
+    esp_vfs_dev_uart_use_driver(CONFIG_ESP_CONSOLE_UART_NUM);
+
+    console_config.max_cmdline_length = APP_CONSOLE_MAX_CMDLINE_LEN;
+    err = esp_console_init(&console_config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to initialise the console");
+        return err;
+    }
+    linenoiseSetMultiLine(1);
+    esp_console_register_help_command();
+    esp_console_cmd_register(&trace_cmd);
+    esp_console_cmd_register(&latency_cmd);
+
+    if (xTaskCreate(app_console_task, "app_console", APP_CONSOLE_TASK_STACK, NULL,
+                APP_CONSOLE_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the console task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
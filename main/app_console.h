@@ -0,0 +1,28 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+#include <esp_err.h>
+
+#define APP_CONSOLE_TASK_PRIORITY 2
+#define APP_CONSOLE_TASK_STACK 4096
+#define APP_CONSOLE_MAX_CMDLINE_LEN 128
+
+/**
+ * Start the serial console and register the commands of the bridge
+ *
+ * Commands:
+ *  - trace dump [count]: print the latest records of the trace ring
+ *  - trace live on|off: print the records as they come, or only keep them
+ *  - trace stats: print the number of records written and lost
+ *  - latency [reset]: print the latency percentiles and throughput of the commands
+ *    per device, or clear them
+ *
+ * @return ESP_OK if successful.
+ * @return error in case of failures.
+ */
+esp_err_t app_console_start(void);
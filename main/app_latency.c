@@ -0,0 +1,277 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <esp_rmaker_core.h>
+#include <sdkconfig.h>
+
+#include "app_latency.h"
+
+#define DIAG_DEV_NAME "Bridge Latency"
+
+/* Upper bounds of the buckets in microseconds, 1-1.5-2-3-5-7 per decade from
+ * 100 us to 70 s. Everything above goes to the last bucket. */
+static const uint32_t s_bucket_us[APP_LATENCY_BUCKETS - 1] = {
+    100, 150, 200, 300, 500, 700,
+    1000, 1500, 2000, 3000, 5000, 7000,
+    10000, 15000, 20000, 30000, 50000, 70000,
+    100000, 150000, 200000, 300000, 500000, 700000,
+    1000000, 1500000, 2000000, 3000000, 5000000, 7000000,
+    10000000, 15000000, 20000000, 30000000, 50000000, 70000000,
+};
+
+static const char *s_stage_names[APP_LATENCY_STAGES] = {
+    [APP_LATENCY_ACCEPT] = "accept",
+    [APP_LATENCY_QUEUE] = "queue",
+    [APP_LATENCY_ATT] = "att",
+    [APP_LATENCY_REPORT] = "report",
+    [APP_LATENCY_TOTAL] = "total",
+};
+
+struct latency_dev {
+    /* Empty if the slot is free */
+    char name[APP_LATENCY_NAME_LEN];
+    /* Halved whenever a bucket would overflow, which keeps the percentiles */
+    uint16_t hist[APP_LATENCY_STAGES][APP_LATENCY_BUCKETS];
+    uint32_t max_us[APP_LATENCY_STAGES];
+    /* Commands delivered, and bytes written for them, since the reset */
+    uint32_t commands;
+    uint32_t bytes;
+    int64_t since;
+};
+
+static struct latency_dev s_devs[MAX_DEV];
+/* Records come from the BLE host task, and are read from the console and timer tasks */
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void app_latency_reset_dev(uint8_t dev_index, const char *name, uint8_t instance)
+{
+    struct latency_dev *dev = &s_devs[dev_index];
+
+    portENTER_CRITICAL(&s_lock);
+    memset(dev, 0, sizeof(*dev));
+    if (name && instance) {
+        snprintf(dev->name, sizeof(dev->name), "%s/%d", name, instance);
+    } else if (name) {
+        snprintf(dev->name, sizeof(dev->name), "%s", name);
+    }
+    dev->since = esp_timer_get_time();
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void app_latency_record(uint8_t dev_index, app_latency_stage_t stage, int64_t us)
+{
+    struct latency_dev *dev = &s_devs[dev_index];
+    uint16_t *hist = dev->hist[stage];
+    int i, b = 0;
+
+    if (us < 0) {
+        us = 0;
+    } else if (us > UINT32_MAX) {
+        us = UINT32_MAX;
+    }
+    while (b < APP_LATENCY_BUCKETS - 1 && us > s_bucket_us[b]) {
+        b++;
+    }
+    portENTER_CRITICAL(&s_lock);
+    if (hist[b] == UINT16_MAX) {
+        for (i = 0; i < APP_LATENCY_BUCKETS; i++) {
+            hist[i] /= 2;
+        }
+    }
+    hist[b]++;
+    if (us > dev->max_us[stage]) {
+        dev->max_us[stage] = us;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void app_latency_count(uint8_t dev_index, uint32_t bytes)
+{
+    portENTER_CRITICAL(&s_lock);
+    s_devs[dev_index].commands++;
+    s_devs[dev_index].bytes += bytes;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+/**
+ * Returns the upper bound of the bucket holding the given fraction (in percent) of
+ * the samples, or the largest sample if that is the last bucket
+ */
+static uint32_t app_latency_percentile(const uint32_t *hist, uint32_t count, uint32_t max_us,
+        uint32_t pct)
+{
+    uint32_t rank = (count * pct + 99) / 100, seen = 0;
+    int b;
+
+    for (b = 0; b < APP_LATENCY_BUCKETS - 1; b++) {
+        seen += hist[b];
+        if (seen >= rank) {
+            /* The bound may be above anything recorded */
+            return s_bucket_us[b] < max_us ? s_bucket_us[b] : max_us;
+        }
+    }
+    return max_us;
+}
+
+void app_latency_get(uint8_t dev_index, app_latency_stage_t stage, app_latency_summary_t *summary)
+{
+    uint32_t hist[APP_LATENCY_BUCKETS] = {0};
+    uint32_t max_us = 0;
+    int i, b;
+
+    portENTER_CRITICAL(&s_lock);
+    for (i = 0; i < MAX_DEV; i++) {
+        if ((dev_index != MAX_DEV && i != dev_index) || !s_devs[i].name[0]) {
+            continue;
+        }
+        for (b = 0; b < APP_LATENCY_BUCKETS; b++) {
+            hist[b] += s_devs[i].hist[stage][b];
+        }
+        if (s_devs[i].max_us[stage] > max_us) {
+            max_us = s_devs[i].max_us[stage];
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    memset(summary, 0, sizeof(*summary));
+    for (b = 0; b < APP_LATENCY_BUCKETS; b++) {
+        summary->count += hist[b];
+    }
+    if (!summary->count) {
+        return;
+    }
+    summary->p50_us = app_latency_percentile(hist, summary->count, max_us, 50);
+    summary->p95_us = app_latency_percentile(hist, summary->count, max_us, 95);
+    summary->p99_us = app_latency_percentile(hist, summary->count, max_us, 99);
+    summary->max_us = max_us;
+}
+
+void app_latency_dump(void)
+{
+    app_latency_summary_t summary;
+    char name[APP_LATENCY_NAME_LEN];
+    uint32_t commands, bytes, secs;
+    int64_t since;
+    int i, stage;
+
+    for (i = 0; i < MAX_DEV; i++) {
+        portENTER_CRITICAL(&s_lock);
+        memcpy(name, s_devs[i].name, sizeof(name));
+        commands = s_devs[i].commands;
+        bytes = s_devs[i].bytes;
+        since = s_devs[i].since;
+        portEXIT_CRITICAL(&s_lock);
+        if (!name[0]) {
+            continue;
+        }
+        secs = (esp_timer_get_time() - since) / 1000000;
+        if (!secs) {
+            secs = 1;
+        }
+        printf("%s: %u commands (%u/min), %u bytes (%u B/s) in %u s\n", name, commands,
+                commands * 60 / secs, bytes, bytes / secs, secs);
+        for (stage = 0; stage < APP_LATENCY_STAGES; stage++) {
+            app_latency_get(i, stage, &summary);
+            if (!summary.count) {
+                continue;
+            }
+            printf("  %-7s n=%-6u p50=%u.%u p95=%u.%u p99=%u.%u max=%u.%u ms\n",
+                    s_stage_names[stage], summary.count,
+                    summary.p50_us / 1000, summary.p50_us % 1000 / 100,
+                    summary.p95_us / 1000, summary.p95_us % 1000 / 100,
+                    summary.p99_us / 1000, summary.p99_us % 1000 / 100,
+                    summary.max_us / 1000, summary.max_us % 1000 / 100);
+        }
+    }
+}
+
+void app_latency_reset(void)
+{
+    int64_t now = esp_timer_get_time();
+    int i;
+
+    portENTER_CRITICAL(&s_lock);
+    for (i = 0; i < MAX_DEV; i++) {
+        memset(s_devs[i].hist, 0, sizeof(s_devs[i].hist));
+        memset(s_devs[i].max_us, 0, sizeof(s_devs[i].max_us));
+        s_devs[i].commands = 0;
+        s_devs[i].bytes = 0;
+        s_devs[i].since = now;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+#ifdef CONFIG_APP_DIAG_DEVICE
+static const char *TAG = "app_latency";
+
+static esp_err_t app_latency_diag_cb(const char *dev_name, const char *name,
+        esp_rmaker_param_val_t val, void *priv_data)
+{
+    /* All the params are read only */
+    return ESP_OK;
+}
+
+static void app_latency_diag_update(void *arg)
+{
+    app_latency_summary_t summary, dev_summary;
+    char slowest[APP_LATENCY_NAME_LEN] = "";
+    uint32_t slowest_us = 0;
+    int i;
+
+    app_latency_get(MAX_DEV, APP_LATENCY_TOTAL, &summary);
+    /* The device holding back the bridge, by its own p95 */
+    for (i = 0; i < MAX_DEV; i++) {
+        app_latency_get(i, APP_LATENCY_TOTAL, &dev_summary);
+        if (dev_summary.count && dev_summary.p95_us > slowest_us) {
+            slowest_us = dev_summary.p95_us;
+            portENTER_CRITICAL(&s_lock);
+            memcpy(slowest, s_devs[i].name, sizeof(slowest));
+            portEXIT_CRITICAL(&s_lock);
+        }
+    }
+    esp_rmaker_update_param(DIAG_DEV_NAME, "Commands", esp_rmaker_int(summary.count));
+    esp_rmaker_update_param(DIAG_DEV_NAME, "P50 ms", esp_rmaker_int(summary.p50_us / 1000));
+    esp_rmaker_update_param(DIAG_DEV_NAME, "P95 ms", esp_rmaker_int(summary.p95_us / 1000));
+    esp_rmaker_update_param(DIAG_DEV_NAME, "P99 ms", esp_rmaker_int(summary.p99_us / 1000));
+    esp_rmaker_update_param(DIAG_DEV_NAME, "Slowest", esp_rmaker_str(slowest));
+}
+
+esp_err_t app_latency_diag_init(void)
+{
+    esp_timer_create_args_t timer_args = {
+        .callback = app_latency_diag_update,
+        .name = "app_latency",
+    };
+    esp_timer_handle_t timer;
+    esp_err_t err;
+
+    esp_rmaker_create_device(DIAG_DEV_NAME, "esp.device.other", app_latency_diag_cb, NULL);
+    esp_rmaker_device_add_param(DIAG_DEV_NAME, "Commands", esp_rmaker_int(0), PROP_FLAG_READ);
+    esp_rmaker_device_add_param(DIAG_DEV_NAME, "P50 ms", esp_rmaker_int(0), PROP_FLAG_READ);
+    esp_rmaker_device_add_param(DIAG_DEV_NAME, "P95 ms", esp_rmaker_int(0), PROP_FLAG_READ);
+    esp_rmaker_device_add_param(DIAG_DEV_NAME, "P99 ms", esp_rmaker_int(0), PROP_FLAG_READ);
+    esp_rmaker_device_add_param(DIAG_DEV_NAME, "Slowest", esp_rmaker_str(""), PROP_FLAG_READ);
+
+    err = esp_timer_create(&timer_args, &timer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create the diagnostics timer");
+        return err;
+    }
+    return esp_timer_start_periodic(timer, APP_LATENCY_DIAG_PERIOD_MS * 1000ULL);
+}
+#else
+esp_err_t app_latency_diag_init(void)
+{
+    return ESP_OK;
+}
+#endif /* CONFIG_APP_DIAG_DEVICE */
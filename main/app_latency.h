@@ -0,0 +1,106 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+#include <stdint.h>
+#include <esp_err.h>
+
+#include "app_ble.h"
+
+/* Number of buckets of a latency histogram, the last one holding everything above
+ * the largest bound (see s_bucket_us in app_latency.c) */
+#define APP_LATENCY_BUCKETS 37
+#define APP_LATENCY_NAME_LEN 24
+/* Interval at which the diagnostics device is updated, if enabled */
+#define APP_LATENCY_DIAG_PERIOD_MS (60 * 1000)
+
+/* Stages of a command, from the RainMaker param callback to the report of the new
+ * value to RainMaker */
+typedef enum {
+    /* Param callback to the write being queued: encoding by the accessory */
+    APP_LATENCY_ACCEPT = 0,
+    /* Queued to handed to the BLE host: scheduling, and reconnection if the device
+     * was not connected */
+    APP_LATENCY_QUEUE,
+    /* Handed to the BLE host to ATT write response: the link and the accessory.
+     * Close to zero for writes without response. */
+    APP_LATENCY_ATT,
+    /* Write response to the new value being reported to RainMaker */
+    APP_LATENCY_REPORT,
+    /* Param callback to the report */
+    APP_LATENCY_TOTAL,
+    APP_LATENCY_STAGES,
+} app_latency_stage_t;
+
+typedef struct {
+    /* Samples in the histogram */
+    uint32_t count;
+    /* Upper bounds of the buckets holding the percentiles, in microseconds */
+    uint32_t p50_us;
+    uint32_t p95_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} app_latency_summary_t;
+
+/**
+ * Start tracking the latency of a device, clearing what was recorded for its slot
+ *
+ * Called by app_ble when a device takes a slot, and with a NULL name when it
+ * leaves it.
+ *
+ * @param[in] dev_index Slot of the device, less than MAX_DEV
+ * @param[in] name Advertised name of the device, or NULL if the slot is free
+ * @param[in] instance Instance of the device
+ */
+void app_latency_reset_dev(uint8_t dev_index, const char *name, uint8_t instance);
+
+/**
+ * Record the latency of a stage of a command
+ *
+ * @param[in] dev_index Slot of the device
+ * @param[in] stage Stage of the command
+ * @param[in] us Time spent in the stage, in microseconds
+ */
+void app_latency_record(uint8_t dev_index, app_latency_stage_t stage, int64_t us);
+
+/**
+ * Count a command delivered to a device, for the throughput
+ *
+ * @param[in] dev_index Slot of the device
+ * @param[in] bytes Length of the value written
+ */
+void app_latency_count(uint8_t dev_index, uint32_t bytes);
+
+/**
+ * Get the percentiles of a stage, for a device or for the whole bridge
+ *
+ * @param[in] dev_index Slot of the device, MAX_DEV for all the devices
+ * @param[in] stage Stage of the commands
+ * @param[out] summary Percentiles of the stage
+ */
+void app_latency_get(uint8_t dev_index, app_latency_stage_t stage, app_latency_summary_t *summary);
+
+/**
+ * Print the percentiles of every stage and the throughput of every device
+ */
+void app_latency_dump(void);
+
+/**
+ * Clear the histograms and throughput counters of all the devices
+ */
+void app_latency_reset(void);
+
+/**
+ * Create the RainMaker device reporting the latency of the bridge, if enabled with
+ * CONFIG_APP_DIAG_DEVICE. Does nothing otherwise.
+ *
+ * Should be called after esp_rmaker_init() but before esp_rmaker_start().
+ *
+ * @return ESP_OK if successful.
+ * @return error in case of failures.
+ */
+esp_err_t app_latency_diag_init(void);
@@ -0,0 +1,318 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <esp_log.h>
+#include <stdio.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <esp_timer.h>
+#include <esp_rmaker_core.h>
+#include <esp_rmaker_standard_params.h>
+#include <esp_rmaker_standard_devices.h>
+
+#include "app_light.h"
+
+/* Index of the characteristics in ble_cfg_t.chrs */
+#define CHR_COLOR 0
+/* Number of app_light_param_type_t values */
+#define PARAM_TYPES (APP_LIGHT_PARAM_SATURATION + 1)
+#define PARAM_NONE 0xff
+
+struct app_light {
+    const app_light_desc_t *desc;
+    /* Name of the RainMaker device, unique across the instances of the model */
+    char name[APP_LIGHT_NAME_LEN];
+    ble_dev_handle_t dev;
+    /* FNV-1a hash of the name of each param in desc->params, so that a RainMaker
+     * update is resolved to its param without going through the names */
+    uint32_t param_hash[APP_LIGHT_MAX_PARAMS];
+    /* Index in desc->params of each param type, PARAM_NONE if not present */
+    uint8_t param_index[PARAM_TYPES];
+    /* Current value of each param type. Zero (off) until set from RainMaker. */
+    uint16_t value[PARAM_TYPES];
+    /* Guards value and coalesced_params, which are set from the RainMaker callback
+     * and read from the BLE host task */
+    portMUX_TYPE lock;
+    /* Param types of writes that were replaced by a newer one, reported along with it */
+    uint32_t coalesced_params;
+    /* Sequence counter of the frames, if the light uses one */
+    uint32_t seq;
+    /* Shared by the lights of the same model */
+    const color_profile_t *profile;
+};
+
+static const char *TAG = "app_light";
+static struct app_light s_lights[APP_LIGHT_MAX];
+static uint8_t s_num_lights;
+static color_profile_t s_profiles[APP_LIGHT_MAX];
+
+static uint32_t app_light_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    }
+    return hash;
+}
+
+static void app_light_write_done(ble_dev_handle_t dev, int status, void *priv)
+{
+    /* priv holds the index of the light above the param types */
+    struct app_light *light = &s_lights[(uint32_t)priv >> 8];
+    uint32_t params = (uint32_t)priv & 0xff;
+    uint16_t value[PARAM_TYPES];
+    int type;
+
+    portENTER_CRITICAL(&light->lock);
+    if (status == WRITE_COALESCED) {
+        light->coalesced_params |= params;
+        portEXIT_CRITICAL(&light->lock);
+        return;
+    }
+    params |= light->coalesced_params;
+    light->coalesced_params = 0;
+    memcpy(value, light->value, sizeof(value));
+    portEXIT_CRITICAL(&light->lock);
+
+    if (status != 0) {
+        ESP_LOGE(TAG, "Failed to update %s; status=%d", light->name, status);
+        return;
+    }
+    for (type = 0; type < PARAM_TYPES; type++) {
+        if (!(params & (1 << type)) || light->param_index[type] == PARAM_NONE) {
+            continue;
+        }
+        const char *name = light->desc->params[light->param_index[type]].name;
+        if (type == APP_LIGHT_PARAM_POWER) {
+            esp_rmaker_update_param(light->name, name, esp_rmaker_bool(value[type]));
+        } else {
+            esp_rmaker_update_param(light->name, name, esp_rmaker_int(value[type]));
+        }
+    }
+}
+
+/**
+ * Writes the color given by the param values to the light.
+ *
+ * @param values Snapshot of light->value, taken under the lock
+ */
+static esp_err_t app_light_update_dev(struct app_light *light, const uint16_t *values,
+        uint32_t params, int64_t received)
+{
+    const app_light_desc_t *desc = light->desc;
+    void *priv = (void *)(((light - s_lights) << 8) | params);
+    /* Turning a light on or off goes ahead of color changes queued for other lights */
+    write_opts_t opts = {
+        .prio = (params & (1 << APP_LIGHT_PARAM_POWER)) ? WRITE_PRIO_CRITICAL : WRITE_PRIO_INTERACTIVE,
+        .received = received,
+    };
+    uint8_t value[MAX_WRITE_LEN];
+    uint32_t fields[3];
+    color_rgb_t rgb = {0};
+    struct os_mbuf *om;
+    uint8_t *buf;
+    size_t len;
+    int rc;
+
+    if (values[APP_LIGHT_PARAM_POWER]) {
+        color_hsv_t hsv = {
+            .h = values[APP_LIGHT_PARAM_HUE],
+            .s = app_color_percent(values[APP_LIGHT_PARAM_SATURATION]),
+            .v = app_color_percent(values[APP_LIGHT_PARAM_BRIGHTNESS]),
+        };
+        app_color_hsv2rgb(&hsv, &rgb);
+        app_color_apply(light->profile, &rgb);
+    }
+    fields[APP_LIGHT_FIELD_RED] = rgb.r;
+    fields[APP_LIGHT_FIELD_GREEN] = rgb.g;
+    fields[APP_LIGHT_FIELD_BLUE] = rgb.b;
+
+    /* Encode straight into the buffer that will be sent, if the pool has one */
+    om = app_ble_write_buf_get(light->dev);
+    buf = om ? os_mbuf_extend(om, desc->frame.len) : NULL;
+    if (buf) {
+        app_codec_encode(&desc->frame, fields, &light->seq, buf);
+        rc = app_ble_write_mbuf_opts(light->dev, CHR_COLOR, om, &opts, app_light_write_done, priv);
+    } else {
+        if (om) {
+            os_mbuf_free_chain(om);
+        }
+        len = app_codec_encode(&desc->frame, fields, &light->seq, value);
+        rc = app_ble_write_opts(light->dev, CHR_COLOR, value, len, &opts, app_light_write_done, priv);
+    }
+    if (rc != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to update %s", light->name);
+    }
+    return rc;
+}
+
+static esp_err_t app_light_cb(const char *dev_name, const char *name, esp_rmaker_param_val_t val, void *priv_data)
+{
+    struct app_light *light = priv_data;
+    /* Start of the command, for app_latency */
+    int64_t received = esp_timer_get_time();
+    uint32_t hash = app_light_hash(name);
+    uint16_t values[PARAM_TYPES];
+    uint32_t params;
+    int i;
+
+    for (i = 0; i < light->desc->num_params; i++) {
+        if (light->param_hash[i] == hash && strcmp(light->desc->params[i].name, name) == 0) {
+            break;
+        }
+    }
+    if (i == light->desc->num_params) {
+        /* Silently ignoring invalid params */
+        return ESP_OK;
+    }
+    app_light_param_type_t type = light->desc->params[i].type;
+    params = 1 << type;
+    if (type == APP_LIGHT_PARAM_POWER) {
+        ESP_LOGI(TAG, "Received value = %s for %s - %s",
+                val.val.b? "true" : "false", dev_name, name);
+    } else {
+        ESP_LOGI(TAG, "Received value = %d for %s - %s",
+                val.val.i, dev_name, name);
+    }
+    portENTER_CRITICAL(&light->lock);
+    if (type == APP_LIGHT_PARAM_POWER) {
+        light->value[type] = val.val.b;
+    } else {
+        /* Negative values would wrap around to bright ones */
+        light->value[type] = val.val.i < 0 ? 0 : (val.val.i > UINT16_MAX ? UINT16_MAX : val.val.i);
+        /* Whenever the color is set, light power will be ON */
+        if (!light->value[APP_LIGHT_PARAM_POWER]) {
+            light->value[APP_LIGHT_PARAM_POWER] = true;
+            params |= 1 << APP_LIGHT_PARAM_POWER;
+        }
+    }
+    memcpy(values, light->value, sizeof(values));
+    portEXIT_CRITICAL(&light->lock);
+    /* The writes are asynchronous. The params are reported to RainMaker from
+     * app_light_write_done() once the light has actually been updated. */
+    app_light_update_dev(light, values, params, received);
+    return ESP_OK;
+}
+
+static esp_err_t app_light_add_dev(void *priv)
+{
+    struct app_light *light = priv;
+    const app_light_desc_t *desc = light->desc;
+    const app_light_param_t *param;
+    int i;
+
+    /* Create a device and add the relevant parameters to it */
+    param = &desc->params[light->param_index[APP_LIGHT_PARAM_POWER]];
+    esp_rmaker_create_lightbulb_device(light->name, app_light_cb, light, param->def);
+    for (i = 0; i < desc->num_params; i++) {
+        param = &desc->params[i];
+        switch (param->type) {
+        case APP_LIGHT_PARAM_BRIGHTNESS:
+            esp_rmaker_device_add_brightness_param(light->name, param->name, param->def);
+            break;
+        case APP_LIGHT_PARAM_HUE:
+            esp_rmaker_device_add_hue_param(light->name, param->name, param->def);
+            break;
+        case APP_LIGHT_PARAM_SATURATION:
+            esp_rmaker_device_add_saturation_param(light->name, param->name, param->def);
+            break;
+        default:
+            break;
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t app_light_register_instance(const app_light_desc_t *desc, uint8_t instance)
+{
+    struct app_light *light;
+    ble_cfg_t ble_cfg = {0};
+    int i;
+
+    if (s_num_lights == APP_LIGHT_MAX) {
+        ESP_LOGE(TAG, "Cannot register more than %d lights", APP_LIGHT_MAX);
+        return ESP_ERR_NO_MEM;
+    }
+    light = &s_lights[s_num_lights];
+    memset(light, 0, sizeof(*light));
+    light->desc = desc;
+    if (instance) {
+        snprintf(light->name, sizeof(light->name), "%s %d", desc->dev_name, instance + 1);
+    } else {
+        snprintf(light->name, sizeof(light->name), "%s", desc->dev_name);
+    }
+    light->lock = (portMUX_TYPE)portMUX_INITIALIZER_UNLOCKED;
+    memset(light->param_index, PARAM_NONE, sizeof(light->param_index));
+    for (i = 0; i < desc->num_params; i++) {
+        app_light_param_type_t type = desc->params[i].type;
+        if (type >= PARAM_TYPES || !desc->params[i].name || light->param_index[type] != PARAM_NONE) {
+            ESP_LOGE(TAG, "Invalid param %d of %s", i, desc->dev_name);
+            return ESP_ERR_INVALID_ARG;
+        }
+        light->param_index[type] = i;
+        light->param_hash[i] = app_light_hash(desc->params[i].name);
+    }
+    if (light->param_index[APP_LIGHT_PARAM_POWER] == PARAM_NONE) {
+        ESP_LOGE(TAG, "%s has no power param", desc->dev_name);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    for (i = 0; i < s_num_lights; i++) {
+        if (s_lights[i].desc == desc) {
+            light->profile = s_lights[i].profile;
+            break;
+        }
+    }
+    if (!light->profile) {
+        if (app_color_profile_init(&s_profiles[s_num_lights], desc->gamma_x100,
+                    desc->wb_r, desc->wb_g, desc->wb_b) != ESP_OK) {
+            ESP_LOGE(TAG, "Invalid output correction for %s", desc->dev_name);
+            return ESP_ERR_INVALID_ARG;
+        }
+        light->profile = &s_profiles[s_num_lights];
+    }
+
+    ble_cfg.adv_name = desc->adv_name;
+    ble_cfg.instance = instance;
+    ble_cfg.chrs[CHR_COLOR].svc_uuid = desc->svc_uuid;
+    ble_cfg.chrs[CHR_COLOR].chr_uuid = desc->chr_uuid;
+    ble_cfg.num_chrs = 1;
+    ble_cfg.add = app_light_add_dev;
+    ble_cfg.priv = light;
+    ble_cfg.write_no_rsp = desc->write_no_rsp;
+
+    light->dev = app_ble_add_dev(&ble_cfg);
+    if (!light->dev) {
+        return ESP_FAIL;
+    }
+    s_num_lights++;
+    return ESP_OK;
+}
+
+esp_err_t app_light_register(const app_light_desc_t *desc)
+{
+    uint8_t instances;
+    esp_err_t err;
+    int i;
+
+    if (!desc || !desc->dev_name || !app_codec_frame_valid(&desc->frame)
+            || desc->frame.len > MAX_WRITE_LEN || desc->frame.num_fields != 3
+            || desc->num_params > APP_LIGHT_MAX_PARAMS) {
+        ESP_LOGE(TAG, "Invalid light descriptor");
+        return ESP_ERR_INVALID_ARG;
+    }
+    instances = desc->instances ? desc->instances : 1;
+    for (i = 0; i < instances; i++) {
+        err = app_light_register_instance(desc, i);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,89 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include "app_ble.h"
+#include "app_color.h"
+#include "app_codec.h"
+
+/* Maximum number of lights registered with app_light_register(), counting each
+ * instance of a model */
+#define APP_LIGHT_MAX 8
+/* Maximum length of the RainMaker name of a light, including the instance number */
+#define APP_LIGHT_NAME_LEN 32
+/* Maximum number of RainMaker params of a light */
+#define APP_LIGHT_MAX_PARAMS 4
+
+/* Order of the color fields in app_light_desc_t.frame */
+#define APP_LIGHT_FIELD_RED 0
+#define APP_LIGHT_FIELD_GREEN 1
+#define APP_LIGHT_FIELD_BLUE 2
+
+/* What a RainMaker param of a light controls */
+typedef enum {
+    APP_LIGHT_PARAM_POWER = 0,
+    APP_LIGHT_PARAM_BRIGHTNESS,
+    APP_LIGHT_PARAM_HUE,
+    APP_LIGHT_PARAM_SATURATION,
+} app_light_param_type_t;
+
+typedef struct {
+    app_light_param_type_t type;
+    /* Name of the param in RainMaker */
+    const char *name;
+    /* Initial value (0/1 for APP_LIGHT_PARAM_POWER) */
+    uint16_t def;
+} app_light_param_t;
+
+/* Static description of a model of RGB light, from which app_light_register() derives
+ * the RainMaker device, the BLE configuration and the payload of the writes */
+typedef struct {
+    /* Name of the RainMaker device. The second and later instances get their
+     * number appended ("<dev_name> 2" and so on). */
+    const char *dev_name;
+    /* Name seen in BLE advertisement data */
+    const char *adv_name;
+    /* Characteristic the color is written to */
+    const ble_uuid_t *svc_uuid;
+    const ble_uuid_t *chr_uuid;
+    /* Use write without response, see ble_cfg_t.write_no_rsp. The params are then
+     * reported to RainMaker before the light confirms them. */
+    bool write_no_rsp;
+    /* RainMaker params of the device. APP_LIGHT_PARAM_POWER is required. */
+    app_light_param_t params[APP_LIGHT_MAX_PARAMS];
+    uint8_t num_params;
+    /* Frame written to the characteristic, with the APP_LIGHT_FIELD_* color fields */
+    codec_frame_t frame;
+    /* Output correction, see app_color_profile_init() */
+    uint16_t gamma_x100;
+    uint8_t wb_r;
+    uint8_t wb_g;
+    uint8_t wb_b;
+    /* Number of lights of this model to bridge, told apart by their BLE address
+     * (see ble_cfg_t.instance). 0 is taken as 1. Each instance not found keeps the
+     * boot time scan of app_ble_start() going for its full duration. */
+    uint8_t instances;
+} app_light_desc_t;
+
+/**
+ * Register the lights of a model described by a static descriptor
+ *
+ * desc->instances lights are registered, each with its own state and RainMaker
+ * device. The RainMaker device is added once the light is found over BLE. Param updates from
+ * RainMaker are converted to a write of the descriptor's payload, and reported back
+ * once the write completes.
+ *
+ * @param[in] desc Descriptor of the light. It is referred to, and so should not be
+ *                 freed or modified afterwards.
+ *
+ * @return ESP_OK if successful.
+ * @return error in case of failures.
+ */
+esp_err_t app_light_register(const app_light_desc_t *desc);
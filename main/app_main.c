@@ -19,6 +19,9 @@
 
 #include "app_priv.h"
 #include "app_ble.h"
+#include "app_trace.h"
+#include "app_console.h"
+#include "app_latency.h"
 #include "accessories/syska_light.h"
 #include "accessories/playbulb_light.h"
 
@@ -71,14 +74,27 @@ void app_main()
         ESP_LOGE(TAG, "Could not register PlayBulb light");
     }
 
+    /* Format the BLE events in the background, off the BLE host task */
+    app_trace_init();
+
     /* Start BLE and wait for the devices to be added.
      * Note that this should be called after esp_rmaker_init() but before esp_rmaker_start()
      */
     app_ble_start();
 
+    /* Optional device reporting the latency of the commands to RainMaker */
+    if (app_latency_diag_init() != ESP_OK) {
+        ESP_LOGE(TAG, "Could not create the diagnostics device");
+    }
+
     /* Start the ESP RainMaker Agent */
     esp_rmaker_start();
 
+    /* Serial console, for inspecting the bridge while it runs */
+    if (app_console_start() != ESP_OK) {
+        ESP_LOGE(TAG, "Could not start the console");
+    }
+
     /* Start the Wi-Fi.
      * If the node is provisioned, it will start connection attempts,
      * else, it will start Wi-Fi provisioning. The function will return
@@ -0,0 +1,167 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "app_trace.h"
+
+_Static_assert((APP_TRACE_RING_LEN & (APP_TRACE_RING_LEN - 1)) == 0,
+        "APP_TRACE_RING_LEN should be a power of 2");
+
+static const char *TAG = "app_trace";
+
+static const char *s_type_names[APP_TRACE_MAX] = {
+    [APP_TRACE_ADV] = "adv",
+    [APP_TRACE_CONNECT] = "connect",
+    [APP_TRACE_DISCONNECT] = "disconnect",
+    [APP_TRACE_SCAN_DONE] = "scan done",
+    [APP_TRACE_ENC_CHANGE] = "enc change",
+    [APP_TRACE_NOTIFY] = "notify",
+    [APP_TRACE_MTU] = "mtu",
+    [APP_TRACE_WRITE_RSP] = "write rsp",
+    [APP_TRACE_WRITE_DONE] = "write done",
+    [APP_TRACE_STATE] = "state",
+};
+
+static app_trace_rec_t s_ring[APP_TRACE_RING_LEN];
+/* Number of the next record to be written. Writers reserve their slot by
+ * incrementing it, so concurrent writers never share a slot. */
+static uint32_t s_head;
+/* Number of the next record for the trace task, and the records it missed. Only
+ * written by the trace task. */
+static uint32_t s_tail;
+static uint32_t s_lost;
+static bool s_live = true;
+static TaskHandle_t s_task;
+
+void app_trace_record(app_trace_type_t type, uint8_t dev, uint16_t handle, int32_t status)
+{
+    uint32_t seq = __atomic_fetch_add(&s_head, 1, __ATOMIC_RELAXED);
+    app_trace_rec_t *rec = &s_ring[seq & (APP_TRACE_RING_LEN - 1)];
+
+    /* Marked as being written first, so that a reader cannot take a half written
+     * record for a complete one */
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->time_us = esp_timer_get_time();
+    rec->type = type;
+    rec->dev = dev;
+    rec->handle = handle;
+    rec->status = status;
+    __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies a record out of the ring
+ *
+ * @return 0 if the record was copied, a positive value if it has been overwritten
+ * by a newer one, a negative value if it is not completely written yet.
+ */
+static int app_trace_read(uint32_t seq, app_trace_rec_t *out)
+{
+    app_trace_rec_t *rec = &s_ring[seq & (APP_TRACE_RING_LEN - 1)];
+    uint32_t found = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+
+    if (found != seq + 1) {
+        return (found && (int32_t)(found - (seq + 1)) > 0) ? 1 : -1;
+    }
+    memcpy(out, rec, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    /* Overwritten while being copied */
+    return __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == found ? 0 : 1;
+}
+
+static void app_trace_print(const app_trace_rec_t *rec)
+{
+    const char *type = rec->type < APP_TRACE_MAX ? s_type_names[rec->type] : "?";
+
+    if (rec->dev == APP_TRACE_DEV_NONE) {
+        ESP_LOGI(TAG, "%u.%03u %s handle=%u status=%d", rec->time_us / 1000, rec->time_us % 1000,
+                type, rec->handle, rec->status);
+    } else {
+        ESP_LOGI(TAG, "%u.%03u dev %u %s handle=%u status=%d", rec->time_us / 1000,
+                rec->time_us % 1000, rec->dev, type, rec->handle, rec->status);
+    }
+}
+
+static void app_trace_task(void *param)
+{
+    app_trace_rec_t rec;
+    uint32_t head;
+    int rc;
+
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(APP_TRACE_FLUSH_MS));
+        head = __atomic_load_n(&s_head, __ATOMIC_RELAXED);
+        if (head - s_tail > APP_TRACE_RING_LEN) {
+            s_lost += head - s_tail - APP_TRACE_RING_LEN;
+            s_tail = head - APP_TRACE_RING_LEN;
+        }
+        while (s_tail != head) {
+            rc = app_trace_read(s_tail, &rec);
+            if (rc < 0) {
+                /* Still being written. Picked up next time. */
+                break;
+            }
+            if (rc > 0) {
+                s_lost++;
+            } else if (s_live) {
+                app_trace_print(&rec);
+            }
+            s_tail++;
+        }
+    }
+}
+
+esp_err_t app_trace_init(void)
+{
+    if (s_task) {
+        return ESP_OK;
+    }
+    if (xTaskCreate(app_trace_task, "app_trace", APP_TRACE_TASK_STACK, NULL,
+                APP_TRACE_TASK_PRIORITY, &s_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the trace task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void app_trace_set_live(bool live)
+{
+    s_live = live;
+}
+
+void app_trace_dump(uint32_t count)
+{
+    uint32_t head = __atomic_load_n(&s_head, __ATOMIC_RELAXED);
+    uint32_t seq;
+    app_trace_rec_t rec;
+
+    if (count > APP_TRACE_RING_LEN) {
+        count = APP_TRACE_RING_LEN;
+    }
+    if (count > head) {
+        count = head;
+    }
+    for (seq = head - count; seq != head; seq++) {
+        if (app_trace_read(seq, &rec) == 0) {
+            app_trace_print(&rec);
+        }
+    }
+}
+
+void app_trace_get_stats(app_trace_stats_t *stats)
+{
+    stats->recorded = __atomic_load_n(&s_head, __ATOMIC_RELAXED);
+    stats->lost = s_lost;
+    stats->live = s_live;
+}
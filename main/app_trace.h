@@ -0,0 +1,112 @@
+/*
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+/* Number of records kept in the trace ring (a power of 2). Older records are
+ * overwritten, and counted as lost if they were not formatted yet. */
+#define APP_TRACE_RING_LEN 256
+/* Interval at which the trace task formats the new records */
+#define APP_TRACE_FLUSH_MS 500
+/* The trace task runs below everything else that matters */
+#define APP_TRACE_TASK_PRIORITY 1
+#define APP_TRACE_TASK_STACK 3072
+/* Device index of the records that are not about a particular device */
+#define APP_TRACE_DEV_NONE 0xff
+
+typedef enum {
+    /* Advertisement of a registered device. status: RSSI */
+    APP_TRACE_ADV = 0,
+    /* Connection established or failed. handle: connection handle */
+    APP_TRACE_CONNECT,
+    /* handle: connection handle, status: reason */
+    APP_TRACE_DISCONNECT,
+    /* End of a scan. status: reason */
+    APP_TRACE_SCAN_DONE,
+    /* handle: connection handle */
+    APP_TRACE_ENC_CHANGE,
+    /* handle: attribute handle, status: 1 for an indication */
+    APP_TRACE_NOTIFY,
+    /* handle: connection handle, status: MTU */
+    APP_TRACE_MTU,
+    /* Write acknowledged by the peer. handle: attribute handle */
+    APP_TRACE_WRITE_RSP,
+    /* Write reported to the accessory. handle: characteristic index */
+    APP_TRACE_WRITE_DONE,
+    /* Connection state change. handle: previous state << 8 | new state */
+    APP_TRACE_STATE,
+    APP_TRACE_MAX,
+} app_trace_type_t;
+
+typedef struct {
+    /* Number of the record + 1, written last. 0 while the record is being written. */
+    uint32_t seq;
+    /* Lower 32 bits of esp_timer_get_time() */
+    uint32_t time_us;
+    uint8_t type;
+    uint8_t dev;
+    uint16_t handle;
+    int32_t status;
+} app_trace_rec_t;
+
+typedef struct {
+    /* Records written so far */
+    uint32_t recorded;
+    /* Records overwritten before the trace task got to them */
+    uint32_t lost;
+    /* Whether the trace task prints the records as they come */
+    bool live;
+} app_trace_stats_t;
+
+/**
+ * Record an event in the trace ring
+ *
+ * Lock free and safe to call from any task, so meant for the hot paths of the BLE
+ * host task in place of a log line. Nothing is formatted here.
+ *
+ * @param[in] type Type of the event
+ * @param[in] dev Index of the device, APP_TRACE_DEV_NONE if none
+ * @param[in] handle Handle the event is about (see app_trace_type_t)
+ * @param[in] status Status of the event (see app_trace_type_t)
+ */
+void app_trace_record(app_trace_type_t type, uint8_t dev, uint16_t handle, int32_t status);
+
+/**
+ * Start the task that formats the records of the trace ring in the background
+ *
+ * Records can be written before this is called.
+ *
+ * @return ESP_OK if successful.
+ * @return error in case of failures.
+ */
+esp_err_t app_trace_init(void);
+
+/**
+ * Enable or disable the printing of the records by the trace task
+ *
+ * When disabled, records are only kept in the ring, for app_trace_dump().
+ *
+ * @param[in] live true to print the records as they come
+ */
+void app_trace_set_live(bool live);
+
+/**
+ * Print the latest records of the trace ring, from the calling task
+ *
+ * @param[in] count Maximum number of records to print
+ */
+void app_trace_dump(uint32_t count);
+
+/**
+ * Get the statistics of the trace ring
+ *
+ * @param[out] stats Statistics of the trace ring
+ */
+void app_trace_get_stats(app_trace_stats_t *stats);